@@ -0,0 +1,377 @@
+#include "defn.h"
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// Starts a server and a ring of peers on 127.0.0.1, times setup-dht, then runs a query workload against the DHT
+// Usage: ./bench [-n peers] [-r ring size] [-q queries] [-c queries in flight] [-z zipf exponent] [-t server threads] [-p base port] [-v virtual nodes per peer] [-k copies of each record]
+// Run from a directory holding server, peer and StatsCountry.csv. The workload is uniform over the dataset's long names
+// unless -z gives a Zipf exponent, in which case a shuffled name of rank k is asked for with weight 1 / k^z
+
+#define PEERMAX 512         // Most peer processes bench starts
+#define ENTRYPOOL 4         // Entry peers fetched from the server per ring member
+
+struct child {              // A process bench started and the pipes to it
+    pid_t pid;
+    int in;                 // Its stdin
+    int out;                // Its stdout and stderr
+    char lines[4096];       // Output not yet matched by wait_reply
+    int used;
+};
+
+struct child server, peers[PEERMAX];
+int sock;                               // Bench's own Query port, also used to talk to the server
+struct sockaddr_in servAddr;
+struct sockaddr_in benchAddr;
+struct inbox inbox;
+struct outbox outbox;
+uint64_t rngState = 88172645463325252ULL;
+
+void DieWithError( const char *errorMessage ) // External error handling function
+{
+    perror( errorMessage );
+    exit( 1 );
+}
+
+double monotonic_ms() {     // Milliseconds on a clock that never jumps
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+double random_unit() {      // Uniform random number in [0, 1) from xorshift64*
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+
+    return ((rngState * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void start_child(struct child* c, char** argv) {   // Run argv with pipes on its stdin and stdout
+    int in[2], out[2];
+
+    if( pipe(in) < 0 || pipe(out) < 0 ) DieWithError( "bench: pipe() failed" );
+    if( (c->pid = fork()) < 0 ) DieWithError( "bench: fork() failed" );
+
+    if( c->pid == 0 ) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        execv(argv[0], argv);
+        perror( "bench: execv() failed" );
+        _exit( 1 );
+    }
+
+    close(in[0]);
+    close(out[1]);
+    c->in = in[1];
+    c->out = out[0];
+    c->used = 0;
+    fcntl(c->out, F_SETFL, O_NONBLOCK);
+}
+
+void send_line(struct child* c, char* line) {   // Type a command into a child
+    int size = strlen(line);
+
+    if( write(c->in, line, size) != size ) DieWithError( "bench: write() failed" );
+}
+
+int wait_reply(struct child* c, double timeout) {   // Wait for a child to print SUCCESS (returns 1) or FAILURE (0). -1 on timeout
+    double deadline = monotonic_ms() + timeout;
+
+    while(1) {
+        char* success = strstr(c->lines, "SUCCESS");
+        char* failure = strstr(c->lines, "FAILURE");
+        struct pollfd fd = { c->out, POLLIN, 0 };
+        double left = deadline - monotonic_ms();
+        int n;
+
+        // Consume the output up to the first reply
+        if( success != NULL || failure != NULL ) {
+            char* reply = (failure == NULL || (success != NULL && success < failure)) ? success : failure;
+
+            c->used -= reply + 7 - c->lines;
+            memmove(c->lines, reply + 7, c->used + 1);
+            return reply == success;
+        }
+        if( left <= 0 ) return -1;
+
+        poll(&fd, 1, (int) left + 1);
+        if( c->used == sizeof(c->lines) - 1 ) c->used = 0;     // Drop output that holds no reply
+        if( (n = read(c->out, c->lines + c->used, sizeof(c->lines) - 1 - c->used)) > 0 ) c->used += n;
+        c->lines[c->used] = '\0';
+    }
+}
+
+int server_request(void* msg, int size) {   // Send a command to the server and wait for its reply in inbox.data[0]. Returns its size, or -1
+    struct pollfd fd = { sock, POLLIN, 0 };
+
+    if( sendto( sock, msg, size, 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != size )
+        DieWithError( "bench: sendto() sent a different number of bytes than expected" );
+    if( poll(&fd, 1, 200) <= 0 ) return -1;
+
+    return recvfrom( sock, inbox.data[0], BUFFERMAX, 0, NULL, NULL );
+}
+
+void stop_children() {     // Stop the server and every peer
+    if( server.pid > 0 ) kill(server.pid, SIGTERM);
+    for(int i = 0; i < PEERMAX; i++) {
+        if( peers[i].pid > 0 ) kill(peers[i].pid, SIGTERM);
+    }
+    while( wait(NULL) > 0 );
+    server.pid = 0;
+    memset(peers, 0, sizeof(peers));
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile(double* sorted, int n, double p) {
+    int i = (int) ceil(p * n) - 1;
+
+    return sorted[i < 0 ? 0 : i];
+}
+
+int main( int argc, char *argv[] ) {
+    int npeers = 0, ringSize = 8, queries = 10000, window = 1, threads = 1, basePort = 34000, vnodes = VNODES, replicas = REPLICAS;
+    double zipf = 0;
+    struct dht_entry record;
+    char (*names)[128] = malloc(sizeof(*names));
+    double* cdf;
+    int count = 0, capacity = 1;
+    char port[12], line[128], threadArg[12], vnodeArg[12], replicaArg[12];
+    struct user_register reg;
+    struct query_dht queryDht;
+    struct sockaddr_in* entries;
+    int entryCount;
+    struct pending_query* pending;
+    double* latency;
+    int sent = 0, answered = 0, found = 0, lost = 0, inFlight = 0;
+    double start, setupTime, runTime;
+    struct dataset data;
+    int opt;
+
+    while( (opt = getopt(argc, argv, "n:r:q:c:z:t:p:v:k:")) != -1 ) {    // Read options
+        if( opt == 'n' ) npeers = atoi(optarg);
+        else if( opt == 'r' ) ringSize = atoi(optarg);
+        else if( opt == 'q' ) queries = atoi(optarg);
+        else if( opt == 'c' ) window = atoi(optarg);
+        else if( opt == 'z' ) zipf = atof(optarg);
+        else if( opt == 't' ) threads = atoi(optarg);
+        else if( opt == 'p' ) basePort = atoi(optarg);
+        else if( opt == 'v' ) vnodes = atoi(optarg);
+        else if( opt == 'k' ) replicas = atoi(optarg);
+        else argc = 0;
+    }
+    if( npeers == 0 ) npeers = ringSize;
+
+    if( argc == 0 || optind != argc || ringSize < 2 || npeers < ringSize || npeers > PEERMAX || queries < 1
+        || window < 1 || window > QUERYWINDOW || threads < 1 || basePort < 1 || basePort + 3 * npeers + 4 > 65535 || vnodes < 1 || vnodes > VNODEMAX
+        || replicas < 1 || replicas > REPLICAMAX ) {
+        fprintf( stderr, "Usage: %s [-n peers] [-r ring size] [-q queries] [-c queries in flight, at most %d] [-z zipf exponent] [-t server threads] [-p base port] [-v virtual nodes per peer, at most %d] [-k copies of each record, at most %d]\n", argv[0], QUERYWINDOW, VNODEMAX, REPLICAMAX );
+        exit( 1 );
+    }
+
+    // Load every long name of the dataset
+    if( !dataset_open(&data, "StatsCountry.csv") ) DieWithError( "bench: dataset_open() failed" );
+    read_record(&record, &data);    // Skip header line
+    while( read_record(&record, &data) ) {
+        if( count == capacity ) names = realloc(names, (capacity *= 2) * sizeof(*names));
+        strcpy(names[count++], record.longName);
+    }
+    dataset_close(&data);
+    if( count == 0 ) {
+        fprintf( stderr, "bench: StatsCountry.csv has no records\n" );
+        exit( 1 );
+    }
+
+    // Shuffle the names so popularity has nothing to do with file order, then weight rank k by 1 / k^zipf
+    cdf = malloc(count * sizeof(double));
+    for(int i = count - 1; i > 0; i--) {
+        int j = random_unit() * (i + 1);
+
+        memcpy(line, names[i], 128);
+        memcpy(names[i], names[j], 128);
+        memcpy(names[j], line, 128);
+    }
+    for(int i = 0; i < count; i++) cdf[i] = (i ? cdf[i - 1] : 0) + pow(i + 1, -zipf);
+    for(int i = 0; i < count; i++) cdf[i] /= cdf[count - 1];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Bench's own socket takes the ports after the last peer
+    if( ( sock = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
+        DieWithError( "bench: socket() failed" );
+    memset( &benchAddr, 0, sizeof( benchAddr ) );
+    benchAddr.sin_family = AF_INET;
+    benchAddr.sin_addr.s_addr = inet_addr( "127.0.0.1" );
+    benchAddr.sin_port = htons( basePort + 3 * npeers + 3 );
+    if( bind( sock, (struct sockaddr *) &benchAddr, sizeof(benchAddr) ) < 0 )
+        DieWithError( "bench: bind() failed" );
+    servAddr = benchAddr;
+    servAddr.sin_port = htons( basePort );
+
+    // Start the server and wait until it answers
+    sprintf(port, "%d", basePort);
+    sprintf(threadArg, "%d", threads);
+    start_child(&server, (char*[]) { "./server", "-t", threadArg, port, NULL });
+    atexit(stop_children);
+
+    queryDht.command = 6;
+    strcpy(queryDht.user_name, "bench");
+    for(int tries = 0; server_request(&queryDht, sizeof(queryDht)) < 0; tries++) {
+        if( tries == 50 ) {
+            fprintf( stderr, "bench: server did not answer\n" );
+            exit( 1 );
+        }
+    }
+
+    // Start and register the peers
+    sprintf(vnodeArg, "%d", vnodes);
+    sprintf(replicaArg, "%d", replicas);
+    for(int i = 0; i < npeers; i++) {
+        start_child(&peers[i], (char*[]) { "./peer", "-v", vnodeArg, "-k", replicaArg, "127.0.0.1", port, NULL });
+        sprintf(line, "register p%d 127.0.0.1 %d %d %d\n", i, basePort + 3 * i + 1, basePort + 3 * i + 2, basePort + 3 * i + 3);
+        send_line(&peers[i], line);
+    }
+    for(int i = 0; i < npeers; i++) {
+        if( wait_reply(&peers[i], 5000) != 1 ) {
+            fprintf( stderr, "bench: peer p%d failed to register\n", i );
+            exit( 1 );
+        }
+    }
+
+    // Build the ring. The leader prints the server's answer to dht-complete once every record is sent
+    sprintf(line, "setup-dht %d p0\n", ringSize);
+    start = monotonic_ms();
+    send_line(&peers[0], line);
+    if( wait_reply(&peers[0], 60000) != 1 ) {
+        fprintf( stderr, "bench: setup-dht did not finish\n" );
+        exit( 1 );
+    }
+    setupTime = monotonic_ms() - start;
+
+    // Register bench only now, so setup-dht cannot pick it as a ring member
+    reg.command = 0;
+    strcpy(reg.user_name, "bench");
+    strcpy(reg.ipAddr, "127.0.0.1");
+    reg.portFrom = basePort + 3 * npeers + 1;
+    reg.portTo = basePort + 3 * npeers + 2;
+    reg.portQuery = basePort + 3 * npeers + 3;
+    reg.vnodes = vnodes;
+    if( server_request(&reg, sizeof(reg)) < 0 || strcmp(inbox.data[0], "SUCCESS\n") != 0 ) {
+        fprintf( stderr, "bench: server refused to register bench\n" );
+        exit( 1 );
+    }
+
+    // Spread queries over entry peers picked by the server
+    entryCount = ENTRYPOOL * ringSize;
+    entries = malloc(entryCount * sizeof(struct sockaddr_in));
+    for(int i = 0; i < entryCount; i++) {
+        struct query_dht* response = (struct query_dht*) inbox.data[0];
+
+        if( server_request(&queryDht, sizeof(queryDht)) < 0 || inbox.data[0][0] != 6 ) {
+            fprintf( stderr, "bench: server gave no entry peer\n" );
+            exit( 1 );
+        }
+        memset( &entries[i], 0, sizeof( entries[i] ) );
+        entries[i].sin_family = AF_INET;
+        entries[i].sin_addr.s_addr = inet_addr( response->ipAddr );
+        entries[i].sin_port = htons( response->portQuery );
+    }
+
+    // Run the workload with up to window queries in flight. Slot i sends request IDs i, i + QUERYWINDOW, ...
+    pending = calloc(QUERYWINDOW, sizeof(struct pending_query));
+    latency = malloc(queries * sizeof(double));
+    for(int i = 0; i < QUERYWINDOW; i++) pending[i].query.requestId = i - QUERYWINDOW;
+
+    start = monotonic_ms();
+    while( sent < queries || inFlight > 0 ) {
+        struct pollfd fd = { sock, POLLIN, 0 };
+        double now;
+        int received;
+
+        while( sent < queries && inFlight < window ) {
+            struct pending_query* p = pending;
+            double u = random_unit();
+            int lo = 0, hi = count - 1;
+
+            while( lo < hi ) {      // First name whose cumulative weight passes u
+                int mid = (lo + hi) / 2;
+
+                if( cdf[mid] > u ) hi = mid;
+                else lo = mid + 1;
+            }
+
+            while( p->active ) p++;
+            p->query.command = 7;
+            p->query.requesterAddr = benchAddr;
+            p->query.requestId += QUERYWINDOW;
+            strcpy(p->query.longName, names[lo]);
+            p->query.nameLength = strlen(names[lo]) + 1;
+            p->query.hash = hash_name(names[lo]);
+            p->active = 1;
+            p->sentAt = monotonic_ms();
+            if( outbox_add(&outbox, sock, &p->query, QUERY_SIZE(&p->query), &entries[sent % entryCount]) < 0 )
+                DieWithError( "bench: sendmmsg() sent a different number of bytes than expected" );
+            sent++;
+            inFlight++;
+        }
+        if( outbox_flush(&outbox) < 0 )
+            DieWithError( "bench: sendmmsg() sent a different number of bytes than expected" );
+
+        poll(&fd, 1, QUERYTIMEOUT);
+        received = inbox_receive( &inbox, sock, MSG_DONTWAIT );
+        now = monotonic_ms();
+
+        for(int i = 0; i < received; i++) {
+            char* msg = inbox.data[i];
+            unsigned int requestId;
+            struct pending_query* p;
+
+            if( msg[0] == 8 ) requestId = ((struct query_success*) msg)->requestId;
+            else if( msg[0] == 20 ) requestId = ((struct query_failure*) msg)->requestId;
+            else continue;
+
+            p = &pending[requestId % QUERYWINDOW];
+            if( !p->active || p->query.requestId != requestId ) continue;
+            p->active = 0;
+            inFlight--;
+            latency[answered++] = now - p->sentAt;
+            if( msg[0] == 8 ) found++;
+        }
+
+        // A query with no answer after QUERYTIMEOUT is counted as lost
+        for(int i = 0; i < QUERYWINDOW; i++) {
+            if( pending[i].active && now - pending[i].sentAt >= QUERYTIMEOUT ) {
+                pending[i].active = 0;
+                inFlight--;
+                lost++;
+            }
+        }
+    }
+    runTime = monotonic_ms() - start;
+
+    stop_children();
+    qsort(latency, answered, sizeof(double), compare_double);
+
+    printf("Peers        : %d, ring of %d with %d virtual nodes each, %d copies of each record, server threads %d\n", npeers, ringSize, vnodes, replicas, threads);
+    printf("Workload     : %d queries over %d names, %s, %d in flight\n", queries, count, zipf > 0 ? "zipf" : "uniform", window);
+    if( zipf > 0 ) printf("Zipf exponent: %.2f\n", zipf);
+    printf("Setup time   : %.1f ms\n", setupTime);
+    printf("Answered     : %d (%d found, %d not found), %d lost\n", answered, found, answered - found, lost);
+    printf("Throughput   : %.0f queries/s\n", answered / (runTime / 1000));
+    if( answered > 0 ) {
+        printf("Latency p50  : %.3f ms\n", percentile(latency, answered, 0.50));
+        printf("Latency p99  : %.3f ms\n", percentile(latency, answered, 0.99));
+        printf("Latency p999 : %.3f ms\n", percentile(latency, answered, 0.999));
+    }
+
+    return 0;
+}
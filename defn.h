@@ -1,5 +1,7 @@
 #pragma once
 
+#define _GNU_SOURCE     // recvmmsg and sendmmsg
+
 #include <stdio.h>      
 #include <sys/socket.h> 
 #include <arpa/inet.h>  
@@ -7,10 +9,43 @@
 #include <string.h>     
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define BUFFERMAX 1024     // Longest message to receive
+#define BUFFERMAX 65507    // Longest message to receive (largest UDP payload)
+#define RINGMAX 1024       // Most peers a DHT ring can hold
+#define STOREBYTES 8192    // Default size of a STORE datagram
+#define TABLESIZE 512      // Initial slots in a peer's hash table. Must be a power of two
+#define ARENASLAB 128      // Records per arena slab
+#define EVENTMAX 8         // Most epoll events a peer handles per wakeup
+#define NAMEBUCKETS 4096   // Buckets in the server's user name index. Must be a power of two
+#define NAMESHARDS 64      // Locks guarding the name index, each covering every NAMESHARDS-th bucket
+#define WORKERMAX 64       // Most worker threads the server runs
+#define BATCHMAX 32        // Most datagrams moved by one recvmmsg or sendmmsg call
+#define OUTBYTES 262144    // Bytes of datagrams an outbox holds before it must be flushed
+#define CACHESIZE 256      // Default number of query results an entry peer caches
+#define QUERYWINDOW 64     // Most queries query-batch keeps in flight
+#define QUERYTIMEOUT 500   // Milliseconds query-batch waits for an answer before asking again
+#define QUERYRETRIES 3     // Times query-batch sends a query before giving up on it
+#define TRACEMAX 16        // Most hops a traced query records
+#define VNODES 16          // Default number of virtual nodes a peer places on the hash ring
+#define VNODEMAX 256       // Most virtual nodes a peer can ask for
+#define REPLICAS 1         // Default number of peers keeping a copy of each record
+#define REPLICAMAX 8       // Most copies a ring can keep of each record
+#define STREAMWINDOW 16    // Most stream messages a peer has unacknowledged to any one peer
+#define STREAMTIMEOUT 40   // Milliseconds a peer waits for an acknowledgement before sending stream messages again
+#define STREAMRETRIES 50   // Timeouts in a row after which a peer gives up on a stream
+#define AWAITTIMEOUT 10000 // Milliseconds a join, leave or teardown waits on the rest of the ring before going on without it
+#define SOCKETBYTES 1048576    // Default send and receive buffer a peer asks for on its sockets. The kernel may grant less
+#define CREDITIDLE 1000    // Milliseconds after its last STORE that a peer stops sharing the receiver's buffer
+#define PARSEMAX 64        // Most threads a peer parses the dataset with
+#define PARSECHUNK 262144  // Fewest bytes of dataset worth a parsing thread of their own
 
 typedef enum{FREE = 1, LEADER, INDHT} State;
+typedef enum{SERV_SOCKET, SEND_SOCKET, RECV_SOCKET, QUERY_SOCKET, SOCKETKINDS} Socket;   // A peer's sockets, for counting traffic
 
 struct user {
     char user_name[16];
@@ -18,8 +53,27 @@ struct user {
     unsigned short int portFrom;
     unsigned short int portTo;
     unsigned short int portQuery;
+    unsigned short int vnodes;  // Virtual nodes the peer places on the hash ring
     State state;
-    struct user* next;
+    int slot;               // Index of this user in registry.users
+    int poolSlot;           // Index of this user in registry.freeUsers or registry.dhtUsers
+    struct user* next;      // Next user in the same name bucket
+};
+
+struct registry {                       // The server's registered users
+    struct user** users;                // Every registered user, densely packed
+    int count;
+    int capacity;
+    struct user** freeUsers;            // Users in state FREE, densely packed
+    int freeCount;
+    struct user** dhtUsers;             // Users in state LEADER or INDHT, densely packed
+    int dhtCount;
+    struct user* names[NAMEBUCKETS];    // Users indexed by hash_name(user_name)
+    unsigned char ports[65536 / 8];     // Bit set for every port owned by a registered user
+    int states[INDHT + 1];              // Number of users in each State
+    struct user* leader;                // The user in state LEADER, if any
+    pthread_mutex_t nameLocks[NAMESHARDS];  // Guard names, by bucket
+    pthread_mutex_t poolLock;           // Guards the dense arrays, pools and counters against concurrent registrations
 };
 
 struct dht_user {
@@ -28,6 +82,7 @@ struct dht_user {
     unsigned short int portFrom;
     unsigned short int portTo;
     unsigned short int portQuery;
+    unsigned short int vnodes;
 };
 
 struct dht_entry {
@@ -40,11 +95,321 @@ struct dht_entry {
     char region[32];
     char wbCode[3];
     char latestCensus[254];
+    uint64_t hash;      // hash_name(longName), computed once when the record is loaded
     struct dht_entry* next;
 };
 
 
 
+// Compact wire encoding for records
+// Each field is sent as a length byte followed by its characters, so a record
+// costs a few dozen bytes on the wire instead of sizeof(struct dht_entry)
+
+#define ENTRYMAX (9 + sizeof(struct dht_entry))    // Longest packed record, including its hash
+
+static inline int encode_field(char* buf, char* field) {     // Returns number of bytes written
+    int len = strlen(field);
+
+    buf[0] = len;
+    memcpy(buf + 1, field, len);
+    return len + 1;
+}
+
+static inline int decode_field(char* buf, char* field, int size) {  // Returns number of bytes read
+    int len = (unsigned char) buf[0];
+    int copy = len < size ? len : size - 1;
+
+    memcpy(field, buf + 1, copy);
+    field[copy] = '\0';
+    return len + 1;
+}
+
+static inline int encode_entry(char* buf, struct dht_entry* record) {   // Returns number of bytes written
+    char* p = buf;
+
+    memcpy(p, &record->hash, sizeof(uint64_t));     // Carry the hash so receivers never recompute it
+    p += sizeof(uint64_t);
+    p += encode_field(p, record->countryCode);
+    p += encode_field(p, record->shortName);
+    p += encode_field(p, record->tableName);
+    p += encode_field(p, record->longName);
+    p += encode_field(p, record->alphaCode);
+    p += encode_field(p, record->currency);
+    p += encode_field(p, record->region);
+    p += encode_field(p, record->wbCode);
+    p += encode_field(p, record->latestCensus);
+    return p - buf;
+}
+
+static inline int decode_entry(char* buf, struct dht_entry* record) {   // Returns number of bytes read
+    char* p = buf;
+
+    memcpy(&record->hash, p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    p += decode_field(p, record->countryCode, sizeof(record->countryCode));
+    p += decode_field(p, record->shortName, sizeof(record->shortName));
+    p += decode_field(p, record->tableName, sizeof(record->tableName));
+    p += decode_field(p, record->longName, sizeof(record->longName));
+    p += decode_field(p, record->alphaCode, sizeof(record->alphaCode));
+    p += decode_field(p, record->currency, sizeof(record->currency));
+    p += decode_field(p, record->region, sizeof(record->region));
+    p += decode_field(p, record->wbCode, sizeof(record->wbCode));
+    p += decode_field(p, record->latestCensus, sizeof(record->latestCensus));
+    record->next = NULL;
+    return p - buf;
+}
+
+// Hashing and dataset loading, shared by the peer and the dataset tools
+
+static inline uint64_t hash_name(char* name) {  // 64-bit FNV-1a hash of a long name or user name
+    uint64_t hash = 14695981039346656037ULL;
+
+    for( ; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+
+    // Mix every bit into the top ones, which FNV-1a leaves nearly equal for short names
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Consistent hashing
+// Each peer places vnodes points on the 64-bit ring of hash values. A record
+// belongs to the peer with the first point at or after its hash, wrapping
+// past the top of the ring. More points give a peer a larger and smoother
+// share, and a join or leave only moves the records on the arcs that change
+
+static inline uint64_t vnode_position(struct dht_user* user, int k) {  // Place of a peer's k-th point on the ring
+    char name[32];
+
+    snprintf(name, sizeof(name), "%s#%d", user->user_name, k);
+    return hash_name(name);
+}
+
+// Dataset loading
+// The dataset file is mapped into memory and parsed in one pass. Fields are
+// comma separated and may be quoted, with "" standing for a quote inside
+// quotes. Lines end with \r, \n or \r\n. Each field is written straight
+// into its place in the record and cut short if it does not fit
+
+struct dataset {
+    char* data;         // The mapped file
+    size_t size;
+    size_t pos;         // Offset of the next line to parse
+};
+
+#define RECORDFIELDS 9
+#define FIELD(name) { offsetof(struct dht_entry, name), sizeof(((struct dht_entry*) 0)->name) }
+
+static const struct { size_t offset; size_t size; } recordFields[RECORDFIELDS] = {     // Where each column of a line goes, in file order
+    FIELD(countryCode), FIELD(shortName), FIELD(tableName), FIELD(longName), FIELD(alphaCode),
+    FIELD(currency), FIELD(region), FIELD(wbCode), FIELD(latestCensus)
+};
+
+static inline int dataset_open(struct dataset* set, const char* path) {     // Map a dataset file. Returns 0 if it cannot be read
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    if( fd < 0 ) return 0;
+    if( fstat(fd, &info) < 0 ) {
+        close(fd);
+        return 0;
+    }
+
+    set->size = info.st_size;
+    set->pos = 0;
+    set->data = set->size ? mmap(NULL, set->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if( set->data == MAP_FAILED ) return 0;
+    if( set->size ) madvise(set->data, set->size, MADV_SEQUENTIAL);
+
+    return 1;
+}
+
+static inline void dataset_close(struct dataset* set) {
+    if( set->size ) munmap(set->data, set->size);
+}
+
+static inline int read_record(struct dht_entry* record, struct dataset* set) {    // Parse the next line of the dataset into record. Returns 0 at the end
+    char* p = set->data + set->pos;
+    char* end = set->data + set->size;
+    char* out;
+    char discard[1];
+    int field = 0, length = 0, room, quoted = 0;
+
+    while( p < end && (*p == '\r' || *p == '\n') ) p++;     // Skip line ends and blank lines
+    if( p == end ) {
+        set->pos = set->size;
+        return 0;
+    }
+
+    for(int i = 0; i < RECORDFIELDS; i++) ((char*) record)[recordFields[i].offset] = '\0';
+    out = (char*) record + recordFields[0].offset;
+    room = recordFields[0].size - 1;
+
+    for( ; p < end; p++) {
+        char c = *p;
+
+        if( quoted ) {
+            if( c != '"' ) {
+                if( length < room ) out[length++] = c;
+            }
+            else if( p + 1 < end && p[1] == '"' ) {     // Escaped quote
+                if( length < room ) out[length++] = '"';
+                p++;
+            }
+            else quoted = 0;
+        }
+        else if( c == '"' ) quoted = 1;
+        else if( c == ',' ) {
+            out[length] = '\0';
+            length = 0;
+
+            // Columns past the last field are dropped
+            if( ++field < RECORDFIELDS ) {
+                out = (char*) record + recordFields[field].offset;
+                room = recordFields[field].size - 1;
+            }
+            else {
+                out = discard;
+                room = 0;
+            }
+        }
+        else if( c == '\r' || c == '\n' ) break;
+        else if( length < room ) out[length++] = c;
+    }
+    out[length] = '\0';
+    set->pos = p - set->data;
+
+    record->hash = hash_name(record->longName);
+    record->next = NULL;
+    return 1;
+}
+
+// Dataset snapshots
+// ./snapshot converts the dataset into a file peers map and use without parsing:
+// a header, an index of every record sorted by hash, then the records packed
+// with encode_entry in index order. Records with neighbouring hashes sit next
+// to each other, so a range of the hash space is one run of the file. The header
+// records the size and modification time of the dataset it was made from, and a
+// snapshot whose dataset has changed since is passed over for the dataset itself
+
+#define DATASETFILE "StatsCountry.csv"
+#define SNAPSHOTFILE "StatsCountry.snap"    // Loaded instead of the dataset when present and up to date
+#define SNAPSHOTMAGIC "DHTSNAP3"
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t count;         // Number of records
+    uint32_t dataBytes;     // Bytes of packed records after the index
+    uint64_t sourceBytes;   // Size of the dataset the snapshot was made from
+    int64_t sourceSec;      // And its modification time
+    int64_t sourceNsec;
+};
+
+struct snapshot_index {
+    uint64_t hash;
+    uint32_t offset;        // Where the packed record starts, from the first packed record
+    uint32_t length;
+};
+
+struct snapshot {
+    struct dataset file;            // The mapped snapshot
+    struct snapshot_header* header;
+    struct snapshot_index* index;   // header->count entries
+    char* data;                     // Packed records
+};
+
+static inline int snapshot_open(struct snapshot* snap, const char* path, const char* source) {  // Map and check a snapshot of source. Returns 0 if it is missing, malformed or stale
+    struct stat info;
+    size_t indexBytes;
+
+    if( !dataset_open(&snap->file, path) ) return 0;
+
+    snap->header = (struct snapshot_header*) snap->file.data;
+    if( snap->file.size < sizeof(struct snapshot_header) || memcmp(snap->header->magic, SNAPSHOTMAGIC, 8) != 0 ) {
+        dataset_close(&snap->file);
+        return 0;
+    }
+
+    // Without the dataset there is nothing fresher to fall back to
+    if( stat(source, &info) == 0 && ( snap->header->sourceBytes != (uint64_t) info.st_size ||
+        snap->header->sourceSec != info.st_mtim.tv_sec || snap->header->sourceNsec != info.st_mtim.tv_nsec ) ) {
+        dataset_close(&snap->file);
+        return 0;
+    }
+
+    indexBytes = (size_t) snap->header->count * sizeof(struct snapshot_index);
+    if( snap->file.size != sizeof(struct snapshot_header) + indexBytes + snap->header->dataBytes ) {
+        dataset_close(&snap->file);
+        return 0;
+    }
+
+    snap->index = (struct snapshot_index*) (snap->file.data + sizeof(struct snapshot_header));
+    snap->data = snap->file.data + sizeof(struct snapshot_header) + indexBytes;
+
+    for(uint32_t i = 0; i < snap->header->count; i++) {
+        struct snapshot_index* entry = &snap->index[i];
+
+        if( entry->length > ENTRYMAX || entry->offset > snap->header->dataBytes || entry->length > snap->header->dataBytes - entry->offset ) {
+            dataset_close(&snap->file);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static inline void snapshot_close(struct snapshot* snap) {
+    dataset_close(&snap->file);
+}
+
+struct dht_slot {
+    uint64_t hash;              // Hash of the record's long name, kept beside the pointer so probes stay in the slot array
+    struct dht_entry* record;   // NULL marks an empty slot
+};
+
+struct dht_slab {
+    struct dht_slab* next;
+    int used;                   // Records handed out from this slab
+    struct dht_entry record[ARENASLAB];
+};
+
+struct dht_arena {              // Slab allocator for records. Records are never freed one at a time
+    struct dht_slab* slabs;     // Most recent slab first
+};
+
+struct dht_table {              // Open addressing hash table with Robin Hood probing
+    struct dht_slot* slots;
+    int capacity;               // Number of slots. Always a power of two
+    int count;                  // Number of records stored
+    struct dht_arena arena;     // Owns every record in the table, released with it
+};
+
+struct ring_point {
+    uint64_t position;
+    int member;                 // Index in ring.members of the peer the point belongs to
+};
+
+struct ring {                   // Every peer's points on the hash ring, as this process last heard
+    struct dht_user members[RINGMAX];
+    struct sockaddr_in addr[RINGMAX];   // Recv port of each member
+    int count;
+    struct ring_point* points;  // Sorted by position
+    int pointCount;
+    int self;                   // Index of this process in members, -1 if it is not one
+    int replicas;               // Members keeping a copy of each record, at most count
+    unsigned int epoch;         // Times the ring has changed. Larger is newer
+};
+
+
+
 
 // Definitions for command structures
 // Every command has a structure with fields corresponding to the command parameters
@@ -57,6 +422,7 @@ struct user_register {
     unsigned short int portFrom;
     unsigned short int portTo;
     unsigned short int portQuery;
+    unsigned short int vnodes;
 };
 
 struct deregister {
@@ -85,7 +451,69 @@ struct dht_complete {
 
 struct store {
     char command;   // command 5
-    struct dht_entry record;
+    unsigned short count;   // Number of records that follow, each packed with encode_entry
+    unsigned int epoch;     // Epoch of the ring the sender placed the records by
+};
+
+struct store_batch {        // A STORE being filled for one peer
+    char data[BUFFERMAX];   // Starts with struct store
+    size_t bytes;           // Bytes of data used
+    size_t max;             // Size at which the STORE is sent
+    struct sockaddr_in addr;
+};
+
+struct packed_queue {               // Records packed with encode_entry for one peer, in the order they were added
+    char* data;
+    size_t bytes;
+    size_t room;                    // Bytes data can hold
+    int* lengths;                   // Bytes of each record
+    int count;
+    int lengthRoom;
+};
+
+struct parser {                     // A thread parsing one chunk of the dataset for populate_dataset
+    pthread_t thread;
+    struct dataset chunk;           // The whole mapped file, with pos and size bounding the chunk
+    struct dht_arena parsed;        // Records this process holds itself
+    struct dht_entry* own;          // List of those records
+    struct packed_queue* queues;    // Records for every other peer, indexed like ring.members
+};
+
+struct store_ack {
+    char command;   // command 24
+    uint32_t next;  // Every stream message before this sequence number has arrived
+    int credit;     // Bytes of stream messages the sender may have in flight, the receiver's buffer shared among its senders
+};
+
+struct stream_header {      // Starts every message sent on a stream. The STORE or ring change message it carries follows
+    char command;   // command 25
+    uint32_t seq;   // Place in the sender's stream to this peer
+    uint32_t base;  // Oldest message the sender still holds. It has given up on any before
+};
+
+struct stream_msg {                 // A message waiting to be sent or acknowledged, stream_header included
+    uint32_t seq;
+    int size;
+    struct stream_msg* next;
+    char data[];
+};
+
+struct stream {                     // STOREs and ring change messages this process sends one peer, held in order until each is acknowledged
+    struct sockaddr_in addr;        // Recv port of the peer, which acknowledges from it
+    uint32_t next;                  // Sequence number the next message gets
+    uint32_t unsent;                // First sequence number not sent yet. At most STREAMWINDOW past the oldest
+    double sentAt;                  // When the oldest unacknowledged message was last sent
+    int timeouts;                   // Timeouts since the peer last acknowledged anything
+    int inFlight;                   // Bytes sent and not acknowledged
+    int credit;                     // Bytes the peer last said may be in flight. One message goes out regardless
+    struct stream_msg* head;        // Oldest message not acknowledged
+    struct stream_msg* tail;
+};
+
+struct stream_in {                  // How far a peer's stream to this process has arrived
+    struct sockaddr_in addr;        // Port the peer sends from
+    uint32_t expected;              // Sequence number of the next message to accept
+    double lastAt;                  // When the peer's last message arrived
 };
 
 struct query_dht {
@@ -95,15 +523,93 @@ struct query_dht {
     unsigned short int portQuery;
 };
 
+struct hop {                        // A process a traced query passed through
+    int id;                         // DHT identifier, -1 for the requester
+    double at;                      // Milliseconds on the monotonic clock when the query arrived
+};
+
 struct query {
     char command;   // command 7
-    char longName[128];
     struct sockaddr_in requesterAddr;
+    struct sockaddr_in entryAddr;   // Query port of the first DHT peer the query reached
+    uint64_t hash;              // hash_name(longName), computed once by the requester
+    unsigned int requestId;     // Chosen by the requester and echoed in the answer
+    unsigned char trace;        // Nonzero if each process records a hop in path
+    unsigned char hops;         // Entries of path in use
+    unsigned char nameLength;   // Length of longName including its terminator
+    char longName[128];         // Only the first nameLength characters are sent, unless traced
+    struct hop path[TRACEMAX];  // Sent only when traced
 };
 
 struct query_success {
     char command;   // command 8
-    struct dht_entry record;
+    unsigned int requestId;
+    unsigned char hops;     // Hops of the query's path, sent right after the packed record
+    char record[ENTRYMAX + TRACEMAX * sizeof(struct hop)];  // Record packed with encode_entry. Only the packed bytes are sent
+};
+
+struct query_failure {
+    char command;   // command 20
+    unsigned int requestId;
+    unsigned char hops;
+    struct hop path[TRACEMAX];  // Only the first hops entries are sent
+};
+
+struct pending_query {              // A query-batch query waiting for its answer
+    struct query query;
+    int active;
+    int tries;                      // Times the query has been sent
+    double sentAt;                  // Milliseconds on the monotonic clock
+};
+
+struct peer_stats {                 // What a peer has done since it started
+    int id;
+    int ringSize;
+    int recordsStored;
+    int tableCapacity;
+    uint64_t queriesAnswered;       // Queries for records this peer holds, found or not
+    uint64_t queriesMissing;        // Of those, queries for records it does not have
+    uint64_t cacheHits;             // Queries answered from the entry cache
+    uint64_t queriesForwarded;
+    uint64_t storesForwarded;       // Records passed on by store()
+    uint64_t recordsSent;           // Records populate_dht or a handoff sent to the peers holding them
+    uint64_t storesResent;          // STOREs sent again after a timeout
+    int recvBuffer;                 // Bytes of receive buffer the kernel gave the Recv port
+    uint64_t bytesIn[SOCKETKINDS];
+    uint64_t bytesOut[SOCKETKINDS];
+    uint32_t probeHistogram[16];    // Records 0, 1, ..., 15+ slots from their home slot
+    int populateCalls;
+    double populateMs;              // Time spent in populate_dht, in total
+    double lastPopulateMs;
+};
+
+struct stats_request {
+    char command;   // command 21
+};
+
+struct stats_reply {
+    char command;   // command 22
+    struct peer_stats stats;
+};
+
+struct cache_entry {                // A query_success an entry peer can answer with directly
+    uint64_t hash;
+    char longName[128];
+    int size;                       // Bytes of reply that are sent
+    struct query_success reply;
+    struct cache_entry* next;       // Next entry in the same bucket
+    struct cache_entry* newer;      // Neighbours in order of last use
+    struct cache_entry* older;
+};
+
+struct query_cache {                // Least recently used entries are replaced first
+    struct cache_entry* entries;
+    int capacity;                   // Number of entries. 0 disables the cache
+    int count;                      // Entries in use
+    struct cache_entry** buckets;   // Entries indexed by hash
+    int bucketCount;                // Always a power of two
+    struct cache_entry* newest;
+    struct cache_entry* oldest;
 };
 
 struct leave_dht {
@@ -120,6 +626,10 @@ struct reset_id {
     char command;   // command 11
     int id;
     int ring_size;
+    int replicas;   // Copies the ring keeps of each record, filled in by its members
+    unsigned int epoch;     // Epoch of the ring, filled in by its members
+    int count;      // Number of peers that have appended themselves to members
+    struct dht_user members[RINGMAX];   // Only the first count entries are sent
 };
 
 struct reset_left {
@@ -128,15 +638,6 @@ struct reset_left {
     struct sockaddr_in newAddr;
 };
 
-struct reset_right {
-    char command;   // command 13
-    struct sockaddr_in newAddr;
-};
-
-struct rebuild_dht {
-    char command;   // command 14
-    struct sockaddr_in addr;
-};
 
 struct dht_rebuilt {
     char command;   // command 15
@@ -162,4 +663,102 @@ struct teardown_complete {
     char user_name[16];
 };
 
+struct set_ring {
+    char command;   // command 19
+    struct sockaddr_in ackAddr;     // Recv port to send handoff_done to once records have moved. Port 0 for none
+    int replicas;                   // Copies the ring keeps of each record
+    unsigned int epoch;             // Epoch of the ring, one past the sender's last
+    int count;
+    struct dht_user members[RINGMAX];   // Only the first count entries are sent
+};
+
+struct handoff_done {
+    char command;   // command 23
+    int count;      // Records the sender copied to new holders before this message
+};
+
+#define RESET_ID_SIZE(r) (offsetof(struct reset_id, members) + (r)->count * sizeof(struct dht_user))
+#define SET_RING_SIZE(r) (offsetof(struct set_ring, members) + (r)->count * sizeof(struct dht_user))
+#define QUERY_SIZE(q) ((q)->trace ? offsetof(struct query, path) + (q)->hops * sizeof(struct hop) : offsetof(struct query, longName) + (q)->nameLength)
+#define QUERY_FAILURE_SIZE(f) (offsetof(struct query_failure, path) + (f)->hops * sizeof(struct hop))
+
+
+
+
+// Batched datagram I/O
+// An inbox takes up to BATCHMAX datagrams off a socket in one recvmmsg call.
+// An outbox copies datagrams as they are produced and sends them in order with
+// as few sendmmsg calls as possible
+
+struct inbox {
+    struct mmsghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHMAX];
+    struct sockaddr_in addr[BATCHMAX];      // Sender of each datagram
+    char data[BATCHMAX][BUFFERMAX];
+};
+
+struct outbox {
+    struct mmsghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHMAX];
+    struct sockaddr_in addr[BATCHMAX];      // Destination of each datagram
+    int sock[BATCHMAX];                     // Socket each datagram leaves from
+    int count;
+    int used;                               // Bytes of data holding queued datagrams
+    char data[OUTBYTES];
+};
+
+static inline int inbox_receive(struct inbox* in, int sock, int flags) {  // Returns number of datagrams received, or -1
+    for(int i = 0; i < BATCHMAX; i++) {
+        in->iov[i].iov_base = in->data[i];
+        in->iov[i].iov_len = BUFFERMAX;
+        memset(&in->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        in->msgs[i].msg_hdr.msg_name = &in->addr[i];
+        in->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        in->msgs[i].msg_hdr.msg_iov = &in->iov[i];
+        in->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return recvmmsg(sock, in->msgs, BATCHMAX, flags, NULL);
+}
+
+static inline int outbox_flush(struct outbox* out) {   // Send every queued datagram. Returns -1 if any was cut short
+    int sent = 0;
+
+    while( sent < out->count ) {
+        int run = 1, n;
+
+        // sendmmsg takes one socket, so send the longest run of datagrams sharing one
+        while( sent + run < out->count && out->sock[sent + run] == out->sock[sent] ) run++;
+        if( (n = sendmmsg(out->sock[sent], out->msgs + sent, run, 0)) <= 0 ) return -1;
+
+        for(int i = sent; i < sent + n; i++) {
+            if( out->msgs[i].msg_len != out->iov[i].iov_len ) return -1;
+        }
+        sent += n;
+    }
+
+    out->count = 0;
+    out->used = 0;
+    return 0;
+}
+
+static inline int outbox_add(struct outbox* out, int sock, void* data, int size, struct sockaddr_in* addr) {  // Queue a copy of a datagram. Returns -1 if a flush failed
+    int i;
+
+    if( (out->count == BATCHMAX || out->used + size > OUTBYTES) && outbox_flush(out) < 0 ) return -1;
+
+    i = out->count++;
+    memcpy(out->data + out->used, data, size);
+    out->iov[i].iov_base = out->data + out->used;
+    out->iov[i].iov_len = size;
+    out->addr[i] = *addr;
+    out->sock[i] = sock;
+    memset(&out->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    out->msgs[i].msg_hdr.msg_name = &out->addr[i];
+    out->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    out->msgs[i].msg_hdr.msg_iov = &out->iov[i];
+    out->msgs[i].msg_hdr.msg_iovlen = 1;
+    out->used += size;
 
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "defn.h"
+
+// Reports how a dataset's records spread over home slots of a new hash table and over DHT nodes
+// Usage: ./hashstat <dataset file> <ring size> [virtual nodes per peer]
+// The nodes are placed on the hash ring as peers named node0, node1, ... would be
+
+struct point {
+    uint64_t position;
+    int node;
+};
+
+int compare_point(const void* a, const void* b) {
+    uint64_t x = ((struct point*) a)->position, y = ((struct point*) b)->position;
+
+    return x < y ? -1 : x > y;
+}
+
+int owner(struct point* points, int n, uint64_t hash) {    // Node with the first point at or after hash, wrapping to the first point
+    int lo = 0, hi = n;
+
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if(points[mid].position < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return points[lo == n ? 0 : lo].node;
+}
+
+int main( int argc, char *argv[] ) {
+    struct dht_entry record;
+    int buckets[TABLESIZE] = {0};
+    int histogram[16] = {0};        // Number of slots that are home to 0, 1, ..., 15+ records
+    int* nodes;
+    struct point* points;
+    struct dht_user user;
+    int vnodes = VNODES;
+    int ring_size, records = 0, used = 0, longest = 0, fullest = 0, emptiest;
+    struct dataset data;
+
+    if( argc == 4 ) vnodes = atoi(argv[3]);
+    if( argc < 3 || argc > 4 || (ring_size = atoi(argv[2])) < 1 || vnodes < 1 || vnodes > VNODEMAX ) {
+        fprintf( stderr, "Usage: %s <dataset file> <ring size> [virtual nodes per peer]\n", argv[0] );
+        exit( 1 );
+    }
+
+    if( !dataset_open(&data, argv[1]) ) {
+        perror( "hashstat: dataset_open() failed" );
+        exit( 1 );
+    }
+
+    nodes = calloc(ring_size, sizeof(int));
+    points = malloc(ring_size * vnodes * sizeof(struct point));
+    for(int i = 0; i < ring_size; i++) {
+        sprintf(user.user_name, "node%d", i);
+        for(int k = 0; k < vnodes; k++) {
+            points[i * vnodes + k].position = vnode_position(&user, k);
+            points[i * vnodes + k].node = i;
+        }
+    }
+    qsort(points, ring_size * vnodes, sizeof(struct point), compare_point);
+
+    read_record(&record, &data);    // Skip header line
+    while( read_record(&record, &data) ) {
+        buckets[record.hash % TABLESIZE]++;
+        nodes[owner(points, ring_size * vnodes, record.hash)]++;
+        records++;
+    }
+    dataset_close(&data);
+
+    // Home slot load
+    for(int i = 0; i < TABLESIZE; i++) {
+        if(buckets[i] > 0) used++;
+        if(buckets[i] > longest) longest = buckets[i];
+        histogram[buckets[i] < 15 ? buckets[i] : 15]++;
+    }
+
+    printf("Records      : %d\n", records);
+    printf("Home slots   : %d of %d\n", used, TABLESIZE);
+    printf("Most per slot: %d (mean %.2f over used slots)\n", longest, used ? (double) records / used : 0.0);
+    printf("Records per home slot histogram:\n");
+    for(int i = 0; i < 16; i++) {
+        if(histogram[i] > 0) printf("  %2d%s: %d slots\n", i, i == 15 ? "+" : " ", histogram[i]);
+    }
+
+    // Node load
+    emptiest = nodes[0];
+    printf("\nRecords per node, %d virtual nodes each:\n", vnodes);
+    for(int i = 0; i < ring_size; i++) {
+        printf("  node %d: %d\n", i, nodes[i]);
+        if(nodes[i] > fullest) fullest = nodes[i];
+        if(nodes[i] < emptiest) emptiest = nodes[i];
+    }
+    printf("Max/mean load: %.2f, min/mean load: %.2f\n", fullest * (double) ring_size / records, emptiest * (double) ring_size / records);
+
+    free(points);
+    free(nodes);
+    return 0;
+}
@@ -1,28 +1,97 @@
 #include "defn.h"
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 
 //FUNCTION DECLARATIONS
 void user_register(char*, int, struct sockaddr_in);
 void establish_socket(int*, struct sockaddr_in*, int, char*);
+void size_buffers(int);
 void deregister(char*, int, struct sockaddr_in);
 void setup_dht(struct dht_user*, int);
 void send_set_id(struct dht_user, struct dht_user, struct dht_user, int, int);
 void set_id(struct set_id*);
+void send_ring(struct dht_user*, int, struct sockaddr_in*);
+void set_ring(struct set_ring*);
+void fill_addr(struct sockaddr_in*, char*, int);
+void watch_fd(int);
+void handle_query_port();
+void handle_recv_port();
+void handle_send_port();
+void query_port_command(char*, struct sockaddr_in*);
+void recv_port_command(char*, struct sockaddr_in*);
+void queue_send(int, void*, int, struct sockaddr_in*);
+void flush_sends();
+void handle_command();
 void populate_dht();
-void store(struct dht_entry*);
-void dht_insert(struct dht_entry*, int);
-int compute_record_pos(char*);
+void populate_dataset();
+size_t chunk_end(struct dataset*, size_t, size_t);
+void* parse_chunk(void*);
+void pack_record(struct packed_queue*, struct dht_entry*);
+void populate_snapshot(struct snapshot*);
+void send_partitions(struct dht_entry**);
+void batch_start(struct store_batch*, struct sockaddr_in*);
+void batch_add(struct store_batch*, char*, size_t);
+void batch_finish(struct store_batch*);
+void store(struct dht_entry*, unsigned int);
+int holds(uint64_t);
+struct sockaddr_in* owner_addr(uint64_t);
+struct sockaddr_in* replica_addr(uint64_t);
+void ring_update(struct dht_user*, int);
+int ring_replicas(struct ring*, uint64_t, int*);
+int held_before(struct ring*, int*, int, struct dht_user*);
+int compare_point(const void*, const void*);
+int hand_off(struct dht_user*, int);
+int await_command(char, double);
+void stream_send(void*, int, struct sockaddr_in*);
+char* stream_accept(char*, struct sockaddr_in*);
+int stream_to(struct sockaddr_in*);
+int stream_from(struct sockaddr_in*);
+void stream_push(struct stream*);
+void stream_transmit(struct stream*, struct stream_msg*);
+void ack_stream(struct store_ack*, struct sockaddr_in*);
+void resend_streams();
+int streams_busy();
+int store_credit();
+void drain_streams();
+void finish_handoff();
+void dht_create();
+void dht_insert(struct dht_entry*);
+void dht_place(struct dht_slot);
+void dht_resize(int);
+struct dht_entry* arena_alloc(struct dht_arena*);
+void arena_release(struct dht_arena*);
 void print_record(struct dht_entry);
 void process_query(struct query*);
-struct dht_entry* retrieve_record(char*, int);
-struct dht_entry copy_record(struct dht_entry*);
+struct dht_entry* retrieve_record(char*, uint64_t);
 void delete_dht();
-void delete_dht_list(struct dht_entry*);
+void query_batch(char*, char*);
+void send_pending(struct pending_query*, struct sockaddr_in*);
+double monotonic_ms();
+void trace_hop(struct query*);
+void start_trace(struct query*);
+int attach_trace(char*, struct query*, unsigned char*);
+void print_reply(char*, char*, double);
+void fill_stats(struct peer_stats*);
+void print_stats(struct peer_stats*);
+void count_bytes(int, uint64_t*, ssize_t);
+ssize_t send_counted(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+ssize_t recv_counted(int, void*, size_t, int, struct sockaddr*, socklen_t*);
+void cache_create(int);
+struct cache_entry* cache_lookup(char*, uint64_t);
+void cache_insert(struct query_success*);
+void cache_clear();
+void cache_unlink(struct cache_entry*);
+void cache_push(struct cache_entry*);
 
 //GLOBAL VARS
 int sockServ;                   // Socket descriptors
 int sockSend;
-int sockRecv;
-int sockQuery;
+int sockRecv = -1;              // -1 until the process registers
+int sockQuery = -1;
+int epollFd;                    // Waits on stdin and the Send, Recv and Query sockets
+int stdinFile = 0;              // Whether stdin is a file epoll can't wait on, read a line per pass instead
 struct sockaddr_in servAddr;    // Server address
 struct sockaddr_in fromAddr;    // Peer addresses
 struct sockaddr_in toAddr;
@@ -30,13 +99,33 @@ struct sockaddr_in queryAddr;
 struct sockaddr_in recvAddr;    // Address from received message
 unsigned int recvAddrLen;       // Length of incoming message
 char msgBuffer[ BUFFERMAX ];    // Buffer for received datagrams
+struct inbox inbox;             // Datagrams taken off the Recv or Query port in one call
+struct outbox outbox;           // Datagrams this process has yet to send
 char ipAddr[16];                // IP Address of process
 
 char buf[64], command[64], *token;  // String buffers to hold command
 char user_name[16];                 // Username of process
 int id = -1;                        // DHT identifier. -1 indicates the host is not in a DHT
 int ring_size;                      // Size of DHT ring
-struct dht_entry** hashTable;       // This processes hash table
+struct dht_table hashTable;         // This processes hash table
+struct dht_user self;               // This process as other peers see it
+struct ring ring;                   // Where every record lives
+int vnodes = VNODES;                // Points this process asks to place on the hash ring
+int replicas = REPLICAS;            // Copies of each record kept by the ring this process sets up or is in
+int nextReplica;                    // Holder the next forwarded query goes to, counting round the holders
+int storeBytes = STOREBYTES;        // Largest STORE datagram this process sends
+int parseThreads;                   // Threads populate_dataset parses with. Defaults to one per online CPU
+int socketBytes = SOCKETBYTES;      // Send and receive buffer asked for on each socket. 0 keeps the kernel's default
+int recvBuffer;                     // Bytes of STOREs the Recv port can hold, as granted by the kernel
+struct query_cache cache;           // Replies to queries that entered the DHT here
+struct peer_stats stats;            // Counters reported by the stats command
+int traceQueries = 0;               // Whether queries this process sends record their path
+struct stream* streams;             // STOREs on their way to each peer this process has sent to
+int streamCount;
+struct stream_in* inStreams;        // How far each peer's STOREs to this process have arrived
+int inStreamCount;
+struct handoff_done handoffDone;    // Sent to handoffAck once every STORE of a handoff is acknowledged
+struct sockaddr_in handoffAck;      // Port 0 while no handoff waits on its acknowledgements
 
 //Utility Functions
 void DieWithError( const char *errorMessage ) // External error handling function
@@ -51,586 +140,702 @@ void get_line(char* buffer, int len, FILE* in) {    //Modification of fgets that
 	if (newline) *newline = '\0';
 }
 
-void fill_space(char* c, int i) {
-    c[strlen(c) + 5] = '\0';
-    for(int j = strlen(c); j > i; j--) {
-        c[j + 5] = c[j];
+
+//Main Method
+int main( int argc, char *argv[] ) {
+
+    int opt;
+    int cacheSize = CACHESIZE;
+
+    parseThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if( parseThreads < 1 ) parseThreads = 1;
+    if( parseThreads > PARSEMAX ) parseThreads = PARSEMAX;
+
+    while( (opt = getopt(argc, argv, "s:c:v:k:b:p:")) != -1 ) {    // Read options
+        if( opt == 's' ) storeBytes = atoi(optarg);
+        else if( opt == 'p' ) parseThreads = atoi(optarg);
+        else if( opt == 'b' ) socketBytes = atoi(optarg);
+        else if( opt == 'c' ) cacheSize = atoi(optarg);
+        else if( opt == 'v' ) vnodes = atoi(optarg);
+        else if( opt == 'k' ) replicas = atoi(optarg);
+        else argc = 0;
+    }
+
+    if (argc - optind < 2 || cacheSize < 0 || vnodes < 1 || vnodes > VNODEMAX || replicas < 1 || replicas > REPLICAMAX || socketBytes < 0 || (socketBytes > 0 && socketBytes < storeBytes) || parseThreads < 1 || parseThreads > PARSEMAX)    // Test for correct number of arguments
+    {
+        fprintf( stderr, "Usage: %s [-s STORE datagram bytes] [-c cached query results] [-v virtual nodes, at most %d] [-k copies of each record in a ring this process sets up, at most %d] [-b socket buffer bytes, at least the STORE size] [-p dataset parsing threads, at most %d] <Server IP address> <Echo Port>\n", argv[0], VNODEMAX, REPLICAMAX, PARSEMAX );
+        exit( 1 );
+    }
+
+    cache_create( cacheSize );
+
+    // Create a datagram/UDP socket with server
+    if( ( sockServ = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
+        DieWithError( "Creation of server socket failed" );
+
+    // Construct the server address structure
+    memset( &servAddr, 0, sizeof( servAddr ) ); // Zero out structure
+    servAddr.sin_family = AF_INET;                  // Use internet addr family
+    servAddr.sin_addr.s_addr = inet_addr( argv[optind] ); // Set server's IP address
+    servAddr.sin_port = htons( atoi( argv[optind + 1] ) );  // Set server's port
+
+    printf("Enter commands:\n");
+
+    // Read stdin unbuffered, so no command waits in a stdio buffer while epoll sleeps
+    setvbuf(stdin, NULL, _IONBF, 0);
+    setvbuf(stdout, NULL, _IOLBF, 0);   // Keep replies flowing when stdout is a pipe
+    if( ( epollFd = epoll_create1(0) ) < 0 )
+        DieWithError( "epoll_create1() failed" );
+    // A regular file is always ready, so epoll refuses it with EPERM
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = 0 };
+    if( epoll_ctl( epollFd, EPOLL_CTL_ADD, 0, &event ) < 0 ) {
+        if( errno != EPERM ) DieWithError( "epoll_ctl() failed" );
+        stdinFile = 1;
     }
 
-    c[i+1] = 'B';
-    c[i+2] = 'L';
-    c[i+3] = 'A';
-    c[i+4] = 'N';
-    c[i+5] = 'K';
+    while(1){
+        struct epoll_event events[ EVENTMAX ];
+        int ready = epoll_wait( epollFd, events, EVENTMAX, stdinFile ? 0 : streams_busy() ? STREAMTIMEOUT : -1 );
+
+        if( ready < 0 ) DieWithError( "epoll_wait() failed" );
+
+        for(int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if( fd == 0 ) {                                 //Command typed on stdin
+                get_line( buf, 64, stdin );
+                if( feof(stdin) ) epoll_ctl( epollFd, EPOLL_CTL_DEL, 0, NULL );
+                else handle_command();
+            }
+            else if( fd == sockQuery ) handle_query_port(); //Information sent to the Query port
+            else if( fd == sockRecv ) handle_recv_port();   //Information sent to the Recv port
+            else if( fd == sockSend ) handle_send_port();   //Acknowledgements of STOREs
+        }
+
+        if( stdinFile ) {                                   //Next command from a file on stdin
+            get_line( buf, 64, stdin );
+            if( feof(stdin) ) stdinFile = 0;
+            else handle_command();
+        }
+
+        // Send again any STOREs whose acknowledgement is overdue
+        resend_streams();
+        flush_sends();
+    }
 }
 
-int read_stats_line(char* buffer, FILE* in) {   //Return a line from the StatsCountry file. Returns 0 at EOF
+void watch_fd(int fd) {     // Add a descriptor to the set the main loop waits on
+    struct epoll_event event;
 
-    //Account for the fact that newlines are marked only by carriage returns
-    if( fscanf(in, "%512[ -ӿ]\r", buffer) == EOF) return 0;
-    char* cr = strchr(buffer, '\r');
-    if (cr) *cr = '\0';
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if( epoll_ctl( epollFd, EPOLL_CTL_ADD, fd, &event ) < 0 )
+        DieWithError( "epoll_ctl() failed" );
+}
 
-    //Fill in empty spaces for easier tokenization later
-    for( int i = 0; buffer[i] != '\0'; i++ ) {
-        if( buffer[i] == ',' && (buffer[i+1] == ',' || buffer[i+1] == '\0'))
-        fill_space(buffer, i);
+void handle_query_port() {     // Handle every datagram waiting on the Query port
+    int received = inbox_receive( &inbox, sockQuery, MSG_DONTWAIT );
+
+    if( received < 0 ) DieWithError( "query port: recvmmsg() failed" );
+    for(int i = 0; i < received; i++) {
+        count_bytes( sockQuery, stats.bytesIn, inbox.msgs[i].msg_len );
+        query_port_command( inbox.data[i], &inbox.addr[i] );
+    }
+    flush_sends();
+}
+
+void handle_recv_port() {      // Handle every datagram waiting on the Recv port
+    int received = inbox_receive( &inbox, sockRecv, MSG_DONTWAIT );
+
+    if( received < 0 ) DieWithError( "recv port: recvmmsg() failed" );
+    for(int i = 0; i < received; i++) {
+        count_bytes( sockRecv, stats.bytesIn, inbox.msgs[i].msg_len );
+        recv_port_command( inbox.data[i], &inbox.addr[i] );
     }
+    flush_sends();
+}
 
-    return 1;
+void handle_send_port() {      // Handle every acknowledgement waiting on the Send socket
+    int received = inbox_receive( &inbox, sockSend, MSG_DONTWAIT );
+
+    if( received < 0 ) DieWithError( "send port: recvmmsg() failed" );
+    for(int i = 0; i < received; i++) {
+        count_bytes( sockSend, stats.bytesIn, inbox.msgs[i].msg_len );
+        if( inbox.data[i][0] == 24 ) ack_stream( (struct store_ack*) inbox.data[i], &inbox.addr[i] );
+    }
+    finish_handoff();
+    flush_sends();
 }
 
-char* get_token(char* line, char* delim) {  //Tokenizes string from csv file. Keeps strings surrounded by "" intact
-    char* token = strtok(line, delim);
+void query_port_command(char* msg, struct sockaddr_in* from) {
+    if( msg[0] == 7 ) {               // QUERY COMMAND ------------------------------
+        struct query* datagram = (struct query*) msg;
+        struct cache_entry* hit = cache_lookup(datagram->longName, datagram->hash);
 
-    if( token[0] == '\"' ) {
-        while( token[strlen(token) - 1] != '\"') {  //Continue concating tokens until second " is reached
-            strtok(NULL, delim);
-            token[strlen(token)] = ',';             //Reappend comma that is deleted after strtok() call
+        // Queries on this port come straight from a requester, so this process is their entry peer
+        if( hit != NULL ) {
+            struct query_success reply = hit->reply;
+
+            stats.cacheHits++;
+            trace_hop(datagram);
+            reply.requestId = datagram->requestId;
+            queue_send( sockQuery, &reply, hit->size + attach_trace(reply.record + hit->size - offsetof(struct query_success, record), datagram, &reply.hops), &datagram->requesterAddr );
+        }
+        else {
+            datagram->entryAddr = queryAddr;
+            process_query(datagram);
         }
     }
 
-    return token;
+    else if( msg[0] == 8 ) {          // QUERY-SUCCESS COMMAND ------------------------------
+        struct query_success* datagram = (struct query_success*) msg;
+
+        // Copy of a reply to a query that entered the DHT here
+        if( id != -1 ) cache_insert(datagram);
+    }
+
+    else if( msg[0] == 21 ) {         // STATS COMMAND ------------------------------
+        struct stats_reply reply;
+
+        reply.command = 22;
+        fill_stats(&reply.stats);
+        queue_send( sockQuery, &reply, sizeof(reply), from );
+    }
 }
 
+void recv_port_command(char* msg, struct sockaddr_in* from) {
+    if( msg[0] == 25 ) {              // STREAM COMMAND ------------------------------
+        char* carried = stream_accept(msg, from);
 
-//Main Method
-int main( int argc, char *argv[] ) {
+        // Handle the STORE or ring change message inside once, in the order the sender sent it
+        if( carried != NULL ) recv_port_command(carried, from);
+    }
 
-    if (argc < 3)    // Test for correct number of arguments
-    {
-        fprintf( stderr, "Usage: %s <Server IP address> <Echo Port>\n", argv[0] );
-        exit( 1 );
+    else if( msg[0] == 3 ) {          // SET-ID COMMAND ------------------------------
+        // Comes on the leader's stream, so it is handled before the SET-RING and STOREs that follow it
+        struct set_id* datagram = (struct set_id*) msg;
+        set_id(datagram);
     }
 
-    // Create a datagram/UDP socket with server
-    if( ( sockServ = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
-        DieWithError( "Creation of server socket failed" );
+    else if( msg[0] == 5 ) {          // STORE COMMAND ------------------------------
+        struct store* datagram = (struct store*) msg;
+        char* packed = msg + sizeof(struct store);
 
-    // Construct the server address structure
-    memset( &servAddr, 0, sizeof( servAddr ) ); // Zero out structure
-    servAddr.sin_family = AF_INET;                  // Use internet addr family
-    servAddr.sin_addr.s_addr = inet_addr( argv[1] ); // Set server's IP address
-    servAddr.sin_port = htons( atoi( argv[2] ) );      // Set server's port
+        struct dht_entry record;
 
-    printf("Enter commands:\n");
+        // Unpack every record in the datagram
+        for(int i = 0; i < datagram->count; i++) {
+            packed += decode_entry(packed, &record);
+            store(&record, datagram->epoch);
+        }
+    }
+
+    else if( msg[0] == 7 ) {          // QUERY COMMAND ------------------------------
+        struct query* datagram = (struct query*) msg;
+        process_query(datagram);
+    }
 
+    else if( msg[0] == 10 ) {         // TEARDOWN COMMAND ------------------------------
+        struct teardown* datagram = (struct teardown*) msg;
 
-    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
-    while(1){
-        buf[0] = 1;
-        token = "";
-
-        //Check if the process has been sent information to its Query port
-        if( recvfrom( sockQuery, msgBuffer, BUFFERMAX, MSG_DONTWAIT, (struct sockaddr *) &recvAddr, &recvAddrLen ) != -1 ) {
-            if( msgBuffer[0] == 3 ) {               // SET-ID COMMAND ------------------------------
-                struct set_id* datagram = (struct set_id*) msgBuffer;
-                set_id(datagram);
-            }
+        delete_dht();
+        cache_clear();
 
-            else if( msgBuffer[0] == 7 ) {          // QUERY COMMAND ------------------------------
-                struct query* datagram = (struct query*) msgBuffer;
-                process_query(datagram);
-            }
+        // Propagate teardown command around ring
+        stream_send( datagram, sizeof(struct teardown), &toAddr );
+    }
+
+    else if( msg[0] == 11 ) {         // RESET-ID COMMAND ------------------------------
+        struct reset_id* datagram = (struct reset_id*) msg;
+
+        // Only the numbering changes. Records stay where they are
+        id = datagram->id;
+        ring_size = datagram->ring_size;
+
+        // Replies cached under the old membership may name a peer that has left
+        cache_clear();
 
+        // Propagate reset_id command around ring, adding this process to the member list
+        datagram->id += 1;
+        datagram->replicas = replicas;
+        datagram->epoch = ring.epoch;
+        if( datagram->count < RINGMAX ) datagram->members[datagram->count++] = self;
+        printf("New ID: %d, New Ring Size: %d\n", id, ring_size);
+        stream_send( datagram, RESET_ID_SIZE(datagram), &toAddr );
+    }
+
+    else if( msg[0] == 19 ) {         // SET-RING COMMAND ------------------------------
+        // Comes on the sender's stream, so it is handled before the STOREs the sender places by it
+        struct set_ring* datagram = (struct set_ring*) msg;
+        set_ring(datagram);
+    }
+
+    else if( msg[0] == 12 ) {         // RESET-LEFT COMMAND ------------------------------
+        struct reset_left* datagram = (struct reset_left*) msg;
+
+        // Check if this process is the left neighbor of the calling process
+        if(datagram->port == toAddr.sin_port) {
+            toAddr = datagram->newAddr;
+        }
+        // If not the left neighbor, propagate message around ring
+        else {
+            stream_send( datagram, sizeof(struct reset_left), &toAddr );
         }
-        //Check if the process has been sent information to its Recv port
-        else if ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, MSG_DONTWAIT, (struct sockaddr *) &recvAddr, &recvAddrLen ) != -1 ) {
-            if( msgBuffer[0] == 5 ) {               // STORE COMMAND ------------------------------
-                struct store* datagram = (struct store*) msgBuffer;
-                struct dht_entry* record = calloc(1, sizeof(struct dht_entry));
-                memcpy(record, &(datagram->record), sizeof(struct dht_entry));
+    }
+}
 
-                store(record);
-            }
+void handle_command() {
+    strcpy(command, buf);
+    if( ( token = strtok( buf, " " ) ) == NULL ) return;
 
-            else if( msgBuffer[0] == 7 ) {          // QUERY COMMAND ------------------------------
-                struct query* datagram = (struct query*) msgBuffer;
-                process_query(datagram);
-            }
+    if( strcmp( token, "register" ) == 0){          // REGISTER COMMAND ------------------------------
         
-            else if( msgBuffer[0] == 10 ) {         // TEARDOWN COMMAND ------------------------------
-                struct teardown* datagram = (struct teardown*) msgBuffer;
+        strcpy(user_name, strtok(NULL, " "));
+        char* ip = strtok(NULL, " ");
+        int portFrom = atoi(strtok(NULL, " "));
+        int portTo = atoi(strtok(NULL, " "));
+        int portQuery = atoi(strtok(NULL, " "));
 
-                delete_dht();
 
-                // Propagate teardown command around ring
-                if( sendto( sockSend, datagram, sizeof(struct teardown), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(struct teardown) ) 
-                    DieWithError( "teardown: sendto() sent a different number of bytes than expected" );
-            }
+        user_register(command, sockServ, servAddr);   // Send register info to server
+
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
+            DieWithError( "register: recvfrom() failed" );
         
-            else if( msgBuffer[0] == 11 ) {         // RESET-ID COMMAND ------------------------------
-                struct reset_id* datagram = (struct reset_id*) msgBuffer;
-
-                id = datagram->id;
-                ring_size = datagram->ring_size;
-                hashTable = calloc(353, sizeof(struct dht_entry*));
-
-                // Propagate reset_id command around ring
-                datagram->id += 1;
-                printf("New ID: %d, New Ring Size: %d\n", id, ring_size);
-                if( sendto( sockSend, datagram, sizeof(struct reset_id), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(struct reset_id) ) 
-                    DieWithError( "teardown: sendto() sent a different number of bytes than expected" );
-            }
+        if( strcmp(msgBuffer, "SUCCESS\n") == 0 ){       //If server returns successful, establish the desired sockets
+            //establish_socket( &sockRecv, &fromAddr, portFrom, ip );   // Establish from, to, query sockets
+            //establish_socket( &sockSend, &toAddr, portTo, ip );
+
+            strcpy(ipAddr, ip);
+            strcpy(self.user_name, user_name);
+            strcpy(self.ipAddr, ip);
+            self.portFrom = portFrom;
+            self.portTo = portTo;
+            self.portQuery = portQuery;
+            self.vnodes = vnodes;
+
+            if( ( sockSend = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
+                DieWithError( "Creation of Send socket failed" );       
+            size_buffers( sockSend );
+            watch_fd( sockSend );
         
-            else if( msgBuffer[0] == 12 ) {         // RESET-LEFT COMMAND ------------------------------
-                struct reset_left* datagram = (struct reset_left*) msgBuffer;
+            establish_socket( &sockRecv, &fromAddr, portFrom, ip );
+            establish_socket( &sockQuery, &queryAddr, portQuery, ip );
+
+            // Linux reports twice the buffer it grants, the other half going to its own bookkeeping
+            socklen_t len = sizeof(recvBuffer);
+            if( getsockopt( sockRecv, SOL_SOCKET, SO_RCVBUF, &recvBuffer, &len ) < 0 )
+                DieWithError( "getsockopt() failed" );
+            recvBuffer /= 2;
+
+            // Wait for datagrams on the new sockets
+            watch_fd( sockRecv );
+            watch_fd( sockQuery );
+        }
+        printf("%s", (char *) msgBuffer);        // Only once the sockets are bound, as setup can follow at once
 
-                // Check if this process is the left neighbor of the calling process
-                if(datagram->port == toAddr.sin_port) {
-                    toAddr = datagram->newAddr;
-                }
-                // If not the left neighbor, propagate message around ring
-                else {
-                    if( sendto( sockSend, datagram, sizeof(struct reset_left), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(struct reset_left) ) 
-                        DieWithError( "reset_left: sendto() sent a different number of bytes than expected" );
-                }
-            }
+    }
 
-            else if( msgBuffer[0] == 13 ) {         // RESET-RIGHT COMMAND ------------------------------
-                struct reset_right* datagram = (struct reset_right*) msgBuffer;
-            }
+    else if( strcmp(token, "deregister") == 0 ) {   // DEREGISTER COMMAND ------------------------------
         
-            else if( msgBuffer[0] == 14 ) {         // REBUILD-DHT COMMAND ------------------------------
-                struct rebuild_dht* datagram = (struct rebuild_dht*) msgBuffer;
+        deregister(command, sockServ, servAddr);
 
-                // Build DHT
-                populate_dht();
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
+            DieWithError( "deregister: recvfrom() failed" );
+        
+        printf("%s", (char *) msgBuffer);
+        if( strcmp(msgBuffer, "SUCCESS\n") == 0 ){
+            close(sockServ);
+            close(sockRecv);
+            close(sockSend);
+            close(sockQuery);
+            exit(0);
+        }       
 
-                // Send username
-                if( sendto( sockSend, user_name, sizeof(user_name), 0, (struct sockaddr *) &datagram->addr, sizeof(datagram->addr) ) != sizeof(user_name) ) 
-                    DieWithError( "rebuild_dht: sendto() sent a different number of bytes than expected" );
-            }
-        }     
-        // If there are no packets, read from stdin       
-        else {
-            get_line( buf, 64, stdin );   // Receive command from stdin
-            sleep(0.5);
-            if(buf[0] != 1){
-                strcpy(command, buf);
-                token = strtok( buf, " " );
-            }
-        }
+    }
 
+    else if( strcmp(token, "setup-dht") == 0 ) {    // SETUP-DHT COMMAND ------------------------------
 
-        if( strcmp( token, "register" ) == 0){          // REGISTER COMMAND ------------------------------
-            
-            strcpy(user_name, strtok(NULL, " "));
-            char* ip = strtok(NULL, " ");
-            int portFrom = atoi(strtok(NULL, " "));
-            int portTo = atoi(strtok(NULL, " "));
-            int portQuery = atoi(strtok(NULL, " "));
+        struct setup datagram;
+        struct dht_complete msg;
 
+        // Create datagram
+        datagram.n = atoi(strtok(NULL, " "));
+        datagram.command = 2;
+        strcpy( datagram.user_name, strtok(NULL, " ") );
 
-            user_register(command, sockServ, servAddr);   // Send register info to server
+        // Send datagram to server
+        if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
+            DieWithError( "setup: sendto() sent a different number of bytes than expected" );
 
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
-                DieWithError( "register: recvfrom() failed" );
-            
-            printf("%s", (char *) msgBuffer);
-            if( strcmp(msgBuffer, "SUCCESS\n") == 0 ){       //If server returns successful, establish the desired sockets
-                //establish_socket( &sockRecv, &fromAddr, portFrom, ip );   // Establish from, to, query sockets
-                //establish_socket( &sockSend, &toAddr, portTo, ip );
+        // Receive Success/Failure message
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+            DieWithError( "setup: recvfrom() failed" );
+        
+        // If success is received, then receive the list
+        if( strcmp(msgBuffer, "SUCCESS\n") == 0 ) {
+            char c = 0;
 
-                strcpy(ipAddr, ip);
+            // Receive list
+            if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 )
+                DieWithError( "setup: recvfrom() failed" );   
 
-                if( ( sockSend = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
-                    DieWithError( "Creation of Send socket failed" );       
+            // Extract List
+            struct dht_user* dht_users = (struct dht_user *) msgBuffer;
             
-                establish_socket( &sockRecv, &fromAddr, portFrom, ip );
-                establish_socket( &sockQuery, &queryAddr, portQuery, ip );
-            }
+            // Setup DHT
+            ring_size = datagram.n;
+            setup_dht( dht_users, ring_size );
 
-        }
+            // Send dht-complete message
+            msg.command = 4;
+            strcpy( msg.user_name, datagram.user_name );
+            if( send_counted( sockServ, &msg, sizeof(msg), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(msg) )  // Send datagram to server
+                DieWithError( "dht-complete: sendto() sent a different number of bytes than expected" );
 
-        else if( strcmp(token, "deregister") == 0 ) {   // DEREGISTER COMMAND ------------------------------
-            
-            deregister(command, sockServ, servAddr);
 
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
-                DieWithError( "deregister: recvfrom() failed" );
-            
+            //Receive Success/Failure
+            if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
+                DieWithError( "deregister: recvfrom() failed" );           
             printf("%s", (char *) msgBuffer);
-            if( strcmp(msgBuffer, "SUCCESS\n") == 0 ){
-                close(sockServ);
-                close(sockRecv);
-                close(sockSend);
-                close(sockQuery);
-                exit(0);
-            }       
-
         }
 
-        else if( strcmp(token, "setup-dht") == 0 ) {    // SETUP-DHT COMMAND ------------------------------
 
-            struct setup datagram;
-            struct dht_complete msg;
+    }
 
-            // Create datagram
-            datagram.n = atoi(strtok(NULL, " "));
-            datagram.command = 2;
-            strcpy( datagram.user_name, strtok(NULL, " ") );
+    else if( strcmp(token, "query-dht") == 0) {     // QUERY-DHT COMMAND ------------------------------
+        
+        struct query_dht datagram;
+        struct query_dht* response;
+        struct query query;
+        struct sockaddr_in dhtNode;
+        char queryName[128];
 
-            // Send datagram to server
-            if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
-                DieWithError( "setup: sendto() sent a different number of bytes than expected" );
+        // Create Datagram
+        datagram.command = 6;
+        strcpy( datagram.user_name, strtok(NULL, " ") );
 
-            // Receive Success/Failure message
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                DieWithError( "setup: recvfrom() failed" );
-            
-            // If success is received, then receive the list
-            if( strcmp(msgBuffer, "SUCCESS\n") == 0 ) {
-                char c = 0;
-
-                // Receive list
-                if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 )
-                    DieWithError( "setup: recvfrom() failed" );   
-
-                // Extract List
-                struct dht_user* dht_users = (struct dht_user *) msgBuffer;
-                
-                // Setup DHT
-                ring_size = datagram.n;
-                setup_dht( dht_users, ring_size );
-
-                // Send dht-complete message
-                msg.command = 4;
-                strcpy( msg.user_name, datagram.user_name );
-                if( sendto( sockServ, &msg, sizeof(msg), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(msg) )  // Send datagram to server
-                    DieWithError( "dht-complete: sendto() sent a different number of bytes than expected" );
-
-
-                //Receive Success/Failure
-                if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) // Receive Success/Failure message
-                    DieWithError( "deregister: recvfrom() failed" );           
-                printf("%s", (char *) msgBuffer);
-            }
+        // Send datagram to server
+        if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
+            DieWithError( "query-dht: sendto() sent a different number of bytes than expected" );
+
+        // Receive Success/Failure message
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+            DieWithError( "query-dht: recvfrom() failed" );
 
 
+        if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
+            printf("%s", (char *) msgBuffer);
         }
+        // If success is received, send the query
+        else {
+            // Extract info of intial node to query
+            response = (struct query_dht*) msgBuffer;
 
-        else if( strcmp(token, "query-dht") == 0) {     // QUERY-DHT COMMAND ------------------------------
+            memset( &dhtNode, 0, sizeof( dhtNode ) );
+            dhtNode.sin_family = AF_INET;
+            dhtNode.sin_addr.s_addr = inet_addr( response->ipAddr ); 
+            dhtNode.sin_port = htons( response->portQuery );      
             
-            struct query_dht datagram;
-            struct query_dht* response;
-            struct query query;
-            struct sockaddr_in dhtNode;
-            char queryName[128];
-            struct query_success* fullRecord;
+            // Create query datagram
+            query.command = 7;
 
-            // Create Datagram
-            datagram.command = 6;
-            strcpy( datagram.user_name, strtok(NULL, " ") );
+            printf("Enter long name to serach for: ");
+            get_line( queryName, 128, stdin );
 
-            // Send datagram to server
-            if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
-                DieWithError( "query-dht: sendto() sent a different number of bytes than expected" );
+            strcpy(query.longName, queryName);
+            query.nameLength = strlen(queryName) + 1;
+            query.hash = hash_name(queryName);
+            query.requesterAddr = queryAddr;
+            query.requestId = 0;
+            start_trace(&query);
 
-            // Receive Success/Failure message
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                DieWithError( "query-dht: recvfrom() failed" );
+            // Send query to initial node
+            if( send_counted( sockQuery, &query, QUERY_SIZE(&query), 0, (struct sockaddr *) &dhtNode, sizeof( dhtNode ) ) != (ssize_t) QUERY_SIZE(&query) ) 
+                DieWithError( "query: sendto() sent a different number of bytes than expected" );
 
+            // Receive Success/Failure message
+            if( ( recv_counted( sockQuery, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+                DieWithError( "query: recvfrom() failed" );
+            
+            print_reply(msgBuffer, queryName, monotonic_ms());
+        }
 
-            if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
-                printf("%s", (char *) msgBuffer);
-            }
-            // If success is received, send the query
-            else {
-                // Extract info of intial node to query
-                response = (struct query_dht*) msgBuffer;
-
-                memset( &dhtNode, 0, sizeof( dhtNode ) );
-                dhtNode.sin_family = AF_INET;
-                dhtNode.sin_addr.s_addr = inet_addr( response->ipAddr ); 
-                dhtNode.sin_port = htons( response->portQuery );      
-                
-                // Create query datagram
-                query.command = 7;
-
-                printf("Enter long name to serach for: ");
-                fcntl(0, F_SETFL, fcntl(0, F_GETFL) & (~ O_NONBLOCK));
-                get_line( queryName, 128, stdin );
-                fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
-
-                strcpy(query.longName, queryName);
-                query.requesterAddr = queryAddr;
-
-                // Send query to initial node
-                if( sendto( sockQuery, &query, sizeof(query), 0, (struct sockaddr *) &dhtNode, sizeof( dhtNode ) ) != sizeof(query) ) 
-                    DieWithError( "query: sendto() sent a different number of bytes than expected" );
-
-                // Receive Success/Failure message
-                if( ( recvfrom( sockQuery, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "query: recvfrom() failed" );
-                
-                // Query was successful; print full record
-                if( msgBuffer[0] == 8 ) {
-                    fullRecord = (struct query_success*) msgBuffer;
-                    print_record(fullRecord->record);
-                }
-                // Query was unsuccessful; print failure
-                else {
-                    printf("Record associated with %s not found\n", queryName);
-                }
-            }
+    }
 
-        }
+    else if( strcmp(token, "query-batch") == 0) {   // QUERY-BATCH COMMAND ------------------------------
+        char* username = strtok(NULL, " ");
 
-        else if( strcmp(token, "leave-dht") == 0) {     // LEAVE-DHT COMMAND ------------------------------
-            struct leave_dht datagram;
-            struct teardown teardown;
-            struct reset_id reset;
-            struct reset_left resetLeft;
-            struct reset_right resetRight;
-            struct rebuild_dht rebuild;
-            struct dht_rebuilt rebuilt;
-            char* username;
-            char* new_leader;
+        if( username == NULL ) printf("Usage: query-batch <user name> [file of long names]\n");
+        else query_batch(username, strtok(NULL, ""));
+    }
 
-            // Create datagram
-            username = strtok(NULL, " ");
-            datagram.command = 9;
-            strcpy(datagram.user_name, username);
-            datagram.ring_size = ring_size;
+    else if( strcmp(token, "trace") == 0) {         // TRACE COMMAND ------------------------------
+        char* mode = strtok(NULL, " ");
 
-            // Send datagram to server
-            if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
-                DieWithError( "leave-dht: sendto() sent a different number of bytes than expected" );
+        if( mode != NULL && strcmp(mode, "on") == 0 ) traceQueries = 1;
+        else if( mode != NULL && strcmp(mode, "off") == 0 ) traceQueries = 0;
+        else printf("Usage: trace on|off\n");
+    }
 
+    else if( strcmp(token, "stats") == 0) {         // STATS COMMAND ------------------------------
+        char* ip = strtok(NULL, " ");
+        char* port = strtok(NULL, " ");
 
-            // Receive Success/Failure message
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                DieWithError( "leave-dht: recvfrom() failed" );
+        // Without arguments, report this process. Otherwise ask the peer whose Query port is given
+        if( ip == NULL ) {
+            fill_stats(&stats);
+            print_stats(&stats);
+        }
+        else if( port == NULL ) printf("Usage: stats [<peer IP address> <peer query port>]\n");
+        else {
+            struct stats_request request;
+            struct sockaddr_in peer;
+            struct pollfd fd = { sockServ, POLLIN, 0 };
 
+            request.command = 21;
+            fill_addr( &peer, ip, atoi(port) );
+            if( send_counted( sockServ, &request, sizeof(request), 0, (struct sockaddr *) &peer, sizeof( peer ) ) != sizeof(request) ) 
+                DieWithError( "stats: sendto() sent a different number of bytes than expected" );
 
-            if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
-                printf("%s", (char *) msgBuffer);
-            }
-            // If success is received, rebuild dht
+            if( poll(&fd, 1, QUERYTIMEOUT) <= 0 ) printf("No answer from %s:%s\n", ip, port);
             else {
+                if( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen ) < 0 ) 
+                    DieWithError( "stats: recvfrom() failed" );
+                if( msgBuffer[0] == 22 ) print_stats( &((struct stats_reply*) msgBuffer)->stats );
+            }
+        }
+    }
 
-                // Send teardown to right neighbor
-                teardown.command = 10;
-                if( sendto( sockSend, &teardown, sizeof(teardown), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(teardown) ) 
-                    DieWithError( "teardown: sendto() sent a different number of bytes than expected" );
-
-                // Receive teardown message
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "teardown: recvfrom() failed" );
-                if( msgBuffer[0] != 10 ) {
-                    printf("Teardown error\n");
-                    break;
-                }
+    else if( strcmp(token, "leave-dht") == 0) {     // LEAVE-DHT COMMAND ------------------------------
+        struct leave_dht datagram;
+        struct reset_id reset;
+        struct reset_id* members = (struct reset_id*) msgBuffer;
+        struct reset_left resetLeft;
+        struct dht_rebuilt rebuilt;
+        char* username;
+        int sent;
 
-                // Delete local hash table
-                delete_dht();
+        // Create datagram
+        username = strtok(NULL, " ");
+        datagram.command = 9;
+        strcpy(datagram.user_name, username);
+        datagram.ring_size = ring_size;
 
-                // Send reset_id to right neighbor
-                reset.command = 11;
-                reset.id = 0;
-                reset.ring_size = ring_size - 1;
-                if( sendto( sockSend, &reset, sizeof(reset), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(reset) ) 
-                    DieWithError( "reset_id: sendto() sent a different number of bytes than expected" );
+        // Send datagram to server
+        if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
+            DieWithError( "leave-dht: sendto() sent a different number of bytes than expected" );
 
-                // Receive reset_id message
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "reset_id: recvfrom() failed" );
-                id = -1;
-                ring_size = 0;
 
-                // Send reset_left / reset_right
-                resetLeft.command = 12;
-                resetLeft.newAddr = toAddr;
-                resetLeft.port = fromAddr.sin_port;     // Used to identify which process is the left neighbor
-                resetRight.command = 13;
-                resetRight.newAddr = fromAddr;
-
-                if( sendto( sockSend, &resetLeft, sizeof(resetLeft), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(resetLeft) ) 
-                    DieWithError( "reset_left: sendto() sent a different number of bytes than expected" );
-
-                if( sendto( sockSend, &resetRight, sizeof(resetRight), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(resetRight) ) 
-                    DieWithError( "reset_right: sendto() sent a different number of bytes than expected" );
-
-                // Send rebuild-dht
-                rebuild.command = 14;
-                rebuild.addr = fromAddr;
-                if( sendto( sockSend, &rebuild, sizeof(rebuild), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(rebuild) ) 
-                    DieWithError( "rebuild_dht: sendto() sent a different number of bytes than expected" );
-                
-                // Receive username from new leader after dht is rebuilt
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "reveive new_leader: recvfrom() failed" );
-                new_leader = msgBuffer;
-
-                //Send dht_rebuilt to server
-                rebuilt.command = 15;
-                rebuilt.FLAG = 0;
-                strcpy(rebuilt.user_name, user_name);
-                strcpy(rebuilt.new_leader, new_leader);
-                if( sendto( sockServ, &rebuilt, sizeof(rebuilt), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(rebuilt) ) 
-                    DieWithError( "dht_rebuilt: sendto() sent a different number of bytes than expected" );
+        // Receive Success/Failure message
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+            DieWithError( "leave-dht: recvfrom() failed" );
+
+
+        if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
+            printf("%s", (char *) msgBuffer);
+        }
+        // If success is received, hand this process's records to the peers that take over its points
+        else {
+
+            // Send reset_id to right neighbor
+            reset.command = 11;
+            reset.id = 0;
+            reset.ring_size = ring_size - 1;
+            reset.replicas = replicas;
+            reset.count = 0;
+            stream_send( &reset, RESET_ID_SIZE(&reset), &toAddr );
+
+            // Receive reset_id message, which now lists every remaining peer in ring order. The ring table lists them too
+            if( !await_command(11, monotonic_ms() + AWAITTIMEOUT) ) {
+                printf("leave-dht: RESET-ID did not come back around the ring, leaving by the ring this process knows\n");
+                members->count = 0;
+                for(int i = 1; i < ring.count; i++) members->members[members->count++] = ring.members[(ring.self + i) % ring.count];
             }
+
+            // Have the left neighbor send past this process
+            resetLeft.command = 12;
+            resetLeft.newAddr = toAddr;
+            resetLeft.port = fromAddr.sin_port;     // Used to identify which process is the left neighbor
+            stream_send( &resetLeft, sizeof(resetLeft), &toAddr );
+
+            // Give the remaining peers the ring without this process, then copy each record to the peers now holding it
+            send_ring(members->members, members->count, NULL);
+            sent = hand_off(members->members, members->count);
+            drain_streams();
+            printf("Handed off %d records\n", sent);
+
+            // Leave the ring. Anything still routed here is passed on to its owner
+            delete_dht();
+            cache_clear();
+            id = -1;
+            ring_size = 0;
+
+            //Send dht_rebuilt to server. The right neighbor, now peer 0, becomes the leader
+            rebuilt.command = 15;
+            rebuilt.FLAG = 0;
+            strcpy(rebuilt.user_name, user_name);
+            strcpy(rebuilt.new_leader, members->members[0].user_name);
+            if( send_counted( sockServ, &rebuilt, sizeof(rebuilt), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(rebuilt) ) 
+                DieWithError( "dht_rebuilt: sendto() sent a different number of bytes than expected" );
         }
+    }
 
-        else if( strcmp(token, "join-dht") == 0) {      // JOIN-DHT COMMAND ------------------------------
-            struct join_dht join;
-            struct join_dht* response;
-            struct dht_user leader;
-            struct reset_left resetLeft;
-            struct reset_right resetRight;
-            struct teardown teardown;
-            struct reset_id reset;
-            struct dht_rebuilt rebuilt;
-            char* username;
+    else if( strcmp(token, "join-dht") == 0) {      // JOIN-DHT COMMAND ------------------------------
+        struct join_dht join;
+        struct join_dht* response;
+        struct dht_user leader;
+        struct reset_left resetLeft;
+        struct reset_id reset;
+        struct dht_rebuilt rebuilt;
+        char* username;
+        int received = 0, joined;
 
-            // Create datagram
-            username = strtok(NULL, " ");
-            join.command = 16;
-            strcpy(join.user_name, username);
+        // Create datagram
+        username = strtok(NULL, " ");
+        join.command = 16;
+        strcpy(join.user_name, username);
 
-            // Send datagram to server
-            if( sendto( sockServ, &join, sizeof(join), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(join) ) 
-                DieWithError( "join-dht: sendto() sent a different number of bytes than expected" );
+        // Send datagram to server
+        if( send_counted( sockServ, &join, sizeof(join), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(join) ) 
+            DieWithError( "join-dht: sendto() sent a different number of bytes than expected" );
 
-            // Receive Success/Failure message. On success, receive the leader of the DHT
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                DieWithError( "join-dht: recvfrom() failed" );
+        // Receive Success/Failure message. On success, receive the leader of the DHT
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+            DieWithError( "join-dht: recvfrom() failed" );
 
 
-            if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
-                printf("%s", (char *) msgBuffer);
+        if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
+            printf("%s", (char *) msgBuffer);
+        }
+        // If success is received, take over this process's points on the ring
+        else {
+            // Set old leader as right neighbor
+            response = (struct join_dht*) msgBuffer;
+            leader = response->leader;
+            fill_addr( &toAddr, leader.ipAddr, leader.portFrom );
+
+            //Set ID and ring size. This process becomes the leader
+            id = 0;
+            ring_size = response->ring_size + 1;
+            dht_create(); // Create space for hash table in memory
+
+            // Have the old leader's left neighbor send to this process
+            resetLeft.command = 12;
+            resetLeft.newAddr = fromAddr;
+            resetLeft.port = htons( leader.portFrom );     // Used to identify which process is the left neighbor
+            stream_send( &resetLeft, sizeof(resetLeft), &toAddr );
+
+            // Send reset_id to old leader / new right neighbor
+            reset.command = 11;
+            reset.id = 1;
+            reset.ring_size = ring_size;
+            reset.replicas = replicas;
+            reset.count = 0;
+            stream_send( &reset, RESET_ID_SIZE(&reset), &toAddr );
+
+            // Receive reset_id message, which lists peers 1 to ring_size - 1 in ring order
+            joined = await_command(11, monotonic_ms() + AWAITTIMEOUT);
+            if( !joined ) printf("join-dht: RESET-ID did not come back around the ring, not joining\n");
+            else if( ((struct reset_id*) msgBuffer)->count >= RINGMAX ) {
+                printf("join-dht: the ring already holds %d peers, not joining\n", RINGMAX);
+                joined = 0;
+            }
+
+            if( !joined ) {
+                // Point the old leader's left neighbor back at it, and have the server keep the old leader
+                resetLeft.newAddr = toAddr;
+                resetLeft.port = fromAddr.sin_port;
+                stream_send( &resetLeft, sizeof(resetLeft), &toAddr );
+                delete_dht();
+                id = -1;
+                ring_size = 0;
+                strcpy(rebuilt.new_leader, leader.user_name);
             }
-            // If success is received, rebuild dht
             else {
-                // Set old leader as right neighbor
-                response = (struct join_dht*) msgBuffer;
-                leader = response->leader;
-
-                memset( &toAddr, 0, sizeof( struct sockaddr_in ) );
-                toAddr.sin_family = AF_INET;
-                toAddr.sin_addr.s_addr = inet_addr( leader.ipAddr );
-                toAddr.sin_port = htons( leader.portFrom );
-
-                //Set ID and ring size. This process becomes the leader
-                id = 0;
-                ring_size = response->ring_size + 1;
-                hashTable = calloc(353, sizeof(struct dht_entry*)); // Create space for hash table in memory
-
-                // Send reset_left / reset_right
-                resetLeft.command = 12;
-                resetLeft.newAddr = fromAddr;
-                resetLeft.port = htons( leader.portFrom );     // Used to identify which process is the left neighbor
-                resetRight.command = 13;
-                resetRight.newAddr = toAddr;
-
-                if( sendto( sockSend, &resetLeft, sizeof(resetLeft), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(resetLeft) ) 
-                    DieWithError( "reset_left: sendto() sent a different number of bytes than expected" );
-
-                if( sendto( sockSend, &resetRight, sizeof(resetRight), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(resetRight) ) 
-                    DieWithError( "reset_right: sendto() sent a different number of bytes than expected" );
-
-
-                // Send teardown to old leader
-                teardown.command = 10;
-                if( sendto( sockSend, &teardown, sizeof(teardown), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(teardown) ) 
-                    DieWithError( "teardown: sendto() sent a different number of bytes than expected" );
-
-                // Receive teardown message
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "teardown: recvfrom() failed" );
-                if( msgBuffer[0] != 10 ) {
-                    printf("Teardown error\n");
-                    break;
+                // This process is peer 0. Give every peer the new ring, and collect the records that now fall to this process
+                struct reset_id* members = (struct reset_id*) msgBuffer;
+                int waiting = ring_size - 1;
+
+                replicas = members->replicas;       // Keep as many copies as the ring already does
+                ring.epoch = members->epoch;
+                memmove(members->members + 1, members->members, members->count * sizeof(struct dht_user));
+                members->members[0] = self;
+                send_ring(members->members, members->count + 1, &fromAddr);
+
+                for( ; waiting > 0 && await_command(23, monotonic_ms() + AWAITTIMEOUT); waiting-- ) {
+                    received += ((struct handoff_done*) msgBuffer)->count;
                 }
-
-                // Send reset_id to old leader / new right neighbor
-                reset.command = 11;
-                reset.id = 1;
-                reset.ring_size = ring_size;
-                if( sendto( sockSend, &reset, sizeof(reset), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(reset) ) 
-                    DieWithError( "reset_id: sendto() sent a different number of bytes than expected" );
-
-                // Receive reset_id message
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "reset_id: recvfrom() failed" );
-
-                // Build the DHT
-                populate_dht();
-
-                //Send dht_rebuilt to server
-                rebuilt.command = 15;
-                rebuilt.FLAG = 1;
-                strcpy(rebuilt.user_name, user_name);
+                printf("Received %d records\n", received);
+                if( waiting > 0 ) printf("join-dht: %d peers did not finish handing off records\n", waiting);
                 strcpy(rebuilt.new_leader, user_name);
-                if( sendto( sockServ, &rebuilt, sizeof(rebuilt), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(rebuilt) ) 
-                    DieWithError( "dht_rebuilt: sendto() sent a different number of bytes than expected" );
             }
+
+            //Send dht_rebuilt to server
+            rebuilt.command = 15;
+            rebuilt.FLAG = 1;
+            strcpy(rebuilt.user_name, user_name);
+            if( send_counted( sockServ, &rebuilt, sizeof(rebuilt), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(rebuilt) ) 
+                DieWithError( "dht_rebuilt: sendto() sent a different number of bytes than expected" );
         }
+    }
 
-        else if( strcmp(token, "teardown-dht") == 0) {      // TEARDOWN-DHT COMMAND ------------------------------
+    else if( strcmp(token, "teardown-dht") == 0) {      // TEARDOWN-DHT COMMAND ------------------------------
 
-            struct teardown_dht datagram;
-            struct teardown teardown;
-            struct teardown_complete complete;
-            char* username;
+        struct teardown_dht datagram;
+        struct teardown teardown;
+        struct teardown_complete complete;
+        char* username;
 
-            // Create datagram
-            username = strtok(NULL, " ");
-            datagram.command = 17;
-            strcpy(datagram.user_name, username);
+        // Create datagram
+        username = strtok(NULL, " ");
+        datagram.command = 17;
+        strcpy(datagram.user_name, username);
 
-            // Send datagram to server
-            if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
-                DieWithError( "teardown-dht: sendto() sent a different number of bytes than expected" );
+        // Send datagram to server
+        if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
+            DieWithError( "teardown-dht: sendto() sent a different number of bytes than expected" );
 
-            // Receive Success/Failure message
-            if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                DieWithError( "teardown-dht: recvfrom() failed" );
+        // Receive Success/Failure message
+        if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+            DieWithError( "teardown-dht: recvfrom() failed" );
 
 
-            if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
-                printf("%s", (char *) msgBuffer);
-            }
-            // If success is received, teardown dht
-            else {
-                // Send teardown to right neighbor
-                teardown.command = 10;
-                if( sendto( sockSend, &teardown, sizeof(teardown), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(teardown) ) 
-                    DieWithError( "teardown: sendto() sent a different number of bytes than expected" );
-
-                // Receive teardown message
-                if( ( recvfrom( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "teardown: recvfrom() failed" );
-                if( msgBuffer[0] != 10 ) {
-                    printf("Teardown error\n");
-                    break;
-                }
+        if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
+            printf("%s", (char *) msgBuffer);
+        }
+        // If success is received, teardown dht
+        else {
+            // Send teardown to right neighbor
+            teardown.command = 10;
+            stream_send( &teardown, sizeof(teardown), &toAddr );
 
-                // Teardown this node
-                delete_dht();
+            // Receive teardown message
+            if( !await_command(10, monotonic_ms() + AWAITTIMEOUT) ) printf("teardown-dht: TEARDOWN did not come back around the ring\n");
 
-                // Send teardown-complete
-                complete.command = 18;
-                strcpy(complete.user_name, username);
-                if( sendto( sockServ, &complete, sizeof(complete), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(complete) ) 
-                    DieWithError( "teardown-complete: sendto() sent a different number of bytes than expected" );
+            // Teardown this node
+            delete_dht();
 
-                // Receive Success/Failure message
-                if( ( recvfrom( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
-                    DieWithError( "teardown-complete: recvfrom() failed" );
-                printf("%s", (char *) msgBuffer);
-            }
+            // Send teardown-complete
+            complete.command = 18;
+            strcpy(complete.user_name, username);
+            if( send_counted( sockServ, &complete, sizeof(complete), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(complete) ) 
+                DieWithError( "teardown-complete: sendto() sent a different number of bytes than expected" );
+
+            // Receive Success/Failure message
+            if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+                DieWithError( "teardown-complete: recvfrom() failed" );
+            printf("%s", (char *) msgBuffer);
         }
+    }
 
-        else if( strcmp( token, "test" ) == 0) {
-             char c = 120;
+    else if( strcmp( token, "test" ) == 0) {
+         char c = 120;
 
-            if( sendto( sockServ, &c, 1, 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != 1 )
-       		    DieWithError( "sendto() sent a different number of bytes than expected" );     
+        if( send_counted( sockServ, &c, 1, 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != 1 )
+   		    DieWithError( "sendto() sent a different number of bytes than expected" );     
 
-                  
-        }
+              
     }
 }
 
@@ -644,8 +849,9 @@ void user_register(char* command, int sockServ, struct sockaddr_in servAddr){
     datagram.portFrom = atoi( strtok(NULL, " ") );
     datagram.portTo = atoi( strtok(NULL, " ") );
     datagram.portQuery = atoi( strtok(NULL, " ") );
+    datagram.vnodes = vnodes;
 
-    if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) )  // Send datagram to server
+    if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) )  // Send datagram to server
         DieWithError( "register: sendto() sent a different number of bytes than expected" );
 
 }
@@ -653,6 +859,7 @@ void user_register(char* command, int sockServ, struct sockaddr_in servAddr){
 void establish_socket(int *sock, struct sockaddr_in* addr, int port, char* ip) {
     if( ( *sock = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
         DieWithError( "Creation of socket failed" );
+    size_buffers( *sock );
 
     memset( addr, 0, sizeof( struct sockaddr_in ) );           // Zero out structure
     addr->sin_family = AF_INET;                  // Internet address family
@@ -663,6 +870,13 @@ void establish_socket(int *sock, struct sockaddr_in* addr, int port, char* ip) {
         DieWithError( "Query: bind() failed" );
 }
 
+void size_buffers(int sock) {   // Ask for socketBytes of send and receive buffer. The kernel caps both at its own limits
+    if( socketBytes == 0 ) return;
+
+    if( setsockopt( sock, SOL_SOCKET, SO_RCVBUF, &socketBytes, sizeof(socketBytes) ) < 0 || setsockopt( sock, SOL_SOCKET, SO_SNDBUF, &socketBytes, sizeof(socketBytes) ) < 0 )
+        DieWithError( "setsockopt() failed" );
+}
+
 void deregister(char* command, int sockServ, struct sockaddr_in servAddr) {
     struct deregister datagram; // Datagram structure to send to server
     
@@ -670,7 +884,7 @@ void deregister(char* command, int sockServ, struct sockaddr_in servAddr) {
     datagram.command = 1;
     strcpy( datagram.user_name, strtok(NULL, " ") );
 
-    if( sendto( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) )  // Send datagram to server
+    if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) )  // Send datagram to server
         DieWithError( "register: sendto() sent a different number of bytes than expected" );
 
 }
@@ -681,6 +895,9 @@ void setup_dht(struct dht_user* users, int n) {
         send_set_id( users[i], users[(i-1+n) % n], users[(i+1) % n], i, n);
     }
 
+    //Give each process the hash ring
+    send_ring(users, n, NULL);
+
     //Populate the DHT
     populate_dht();
 }
@@ -693,7 +910,7 @@ void send_set_id(struct dht_user user, struct dht_user left, struct dht_user rig
     memset( &addr, 0, sizeof( addr ) );
     addr.sin_family = AF_INET;              
     addr.sin_addr.s_addr = inet_addr( user.ipAddr ); 
-    addr.sin_port = htons( user.portQuery ) ;     
+    addr.sin_port = htons( user.portFrom ) ;     
 
     // Create message to send to user_i
     mesg.command = 3;
@@ -702,11 +919,8 @@ void send_set_id(struct dht_user user, struct dht_user left, struct dht_user rig
     mesg.left = left;
     mesg.right = right;
 
-    if(id == 0) set_id(&mesg);
-    else {
-        if( sendto( sockSend, &mesg, sizeof(mesg), 0, (struct sockaddr *) &addr, sizeof( addr ) ) != sizeof(mesg)  )
-            DieWithError( "set_id: sendto() sent a different number of bytes than expected" );
-    }
+    if( strcmp(user.user_name, user_name) == 0 ) set_id(&mesg);
+    else stream_send( &mesg, sizeof(mesg), &addr );
 }
 
 void set_id(struct set_id* info) {   
@@ -722,88 +936,746 @@ void set_id(struct set_id* info) {
     toAddr.sin_addr.s_addr = inet_addr( info->right.ipAddr );     
     toAddr.sin_port = htons( info->right.portFrom );
 
-    // Create space for hash table in memory
-    hashTable = calloc(353, sizeof(struct dht_entry*));
+    // Create space for hash table in memory, keeping any records that arrived first
+    if( hashTable.capacity == 0 ) dht_create();
+}
+
+void send_ring(struct dht_user* users, int n, struct sockaddr_in* ackAddr) {  // Send every process in users the ring they make up. With ackAddr, each answers there once its records have moved
+    struct sockaddr_in addr;
+    struct set_ring* mesg = malloc(sizeof(struct set_ring));
+
+    mesg->command = 19;
+    mesg->replicas = replicas;
+    mesg->epoch = ++ring.epoch;     // The sender takes up the ring too, so its STOREs carry the new epoch
+    mesg->count = n;
+    memcpy(mesg->members, users, n * sizeof(struct dht_user));
+    if(ackAddr != NULL) mesg->ackAddr = *ackAddr;
+    else memset(&mesg->ackAddr, 0, sizeof(mesg->ackAddr));
+
+    for(int i = 0; i < n; i++) {
+        if( strcmp(users[i].user_name, user_name) == 0 ) ring_update(users, n);
+        else {
+            fill_addr( &addr, users[i].ipAddr, users[i].portFrom );
+            stream_send( mesg, SET_RING_SIZE(mesg), &addr );
+        }
+    }
+
+    free(mesg);
+    flush_sends();
+}
+
+void set_ring(struct set_ring* info) {     // Take up a new ring and copy records to the peers that now hold them
+    replicas = info->replicas;
+    ring.epoch = info->epoch;
+    handoffDone.command = 23;
+    handoffDone.count = hand_off(info->members, info->count);
+    if(handoffDone.count > 0) printf("Handed off %d records\n", handoffDone.count);
+
+    // Answer once the records have arrived, not just been sent
+    if(info->ackAddr.sin_port != 0) {
+        handoffAck = info->ackAddr;
+        finish_handoff();
+    }
+}
+
+void ring_update(struct dht_user* users, int n) {  // Rebuild the table of points from the members of the ring
+    int points = 0;
+
+    ring.count = n;
+    ring.self = -1;
+    ring.replicas = replicas < n ? replicas : n;
+    for(int i = 0; i < n; i++) {
+        ring.members[i] = users[i];
+        fill_addr( &ring.addr[i], users[i].ipAddr, users[i].portFrom );
+        if( strcmp(users[i].user_name, user_name) == 0 ) ring.self = i;
+        points += users[i].vnodes;
+    }
+
+    ring.points = realloc(ring.points, points * sizeof(struct ring_point));
+    ring.pointCount = 0;
+    for(int i = 0; i < n; i++) {
+        for(int k = 0; k < users[i].vnodes; k++) {
+            ring.points[ring.pointCount].position = vnode_position(&users[i], k);
+            ring.points[ring.pointCount].member = i;
+            ring.pointCount++;
+        }
+    }
+
+    qsort(ring.points, ring.pointCount, sizeof(struct ring_point), compare_point);
+}
+
+int ring_replicas(struct ring* r, uint64_t hash, int* holders) {   // Members keeping a copy of hash, owner first. Returns how many
+    int lo = 0, hi = r->pointCount, count = 0;
+
+    if(r->pointCount == 0) return 0;
+
+    // The owner has the first point at or after hash, wrapping to the first point
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if(r->points[mid].position < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    // Its copies go to the members of the points that follow, skipping any already chosen
+    for(int i = lo; count < r->replicas; i++) {
+        int member = r->points[i % r->pointCount].member;
+
+        if( !held_before(r, holders, count, &r->members[member]) ) holders[count++] = member;
+    }
+
+    return count;
+}
+
+int held_before(struct ring* r, int* holders, int count, struct dht_user* user) {   // Whether user is one of the first count holders on ring r
+    for(int i = 0; i < count; i++) {
+        if( strcmp(r->members[holders[i]].user_name, user->user_name) == 0 ) return 1;
+    }
+    return 0;
+}
+
+int compare_point(const void* a, const void* b) {
+    uint64_t x = ((struct ring_point*) a)->position, y = ((struct ring_point*) b)->position;
+
+    return x < y ? -1 : x > y;
+}
+
+void fill_addr(struct sockaddr_in* addr, char* ip, int port) {  // Fill out sockaddr for a peer's ip and port
+    memset( addr, 0, sizeof( struct sockaddr_in ) );
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = inet_addr( ip );
+    addr->sin_port = htons( port );
+}
+
+void populate_dht() {  // Load the dataset and send each record straight to the peers holding it on the ring
+    struct snapshot snap;
+    double start = monotonic_ms();
+
+    if( snapshot_open(&snap, SNAPSHOTFILE, DATASETFILE) ) {
+        populate_snapshot(&snap);
+        snapshot_close(&snap);
+    }
+    else populate_dataset();
+    drain_streams();
+
+    stats.lastPopulateMs = monotonic_ms() - start;
+    stats.populateMs += stats.lastPopulateMs;
+    stats.populateCalls++;
+}
+
+void populate_dataset() {     // Parse StatsCountry.csv on parseThreads threads and send each record to every peer holding it
+    struct store_batch* batch;
+    struct parser* parsers;
+    struct dht_entry header;
+    struct dataset data;
+    size_t start = 0;
+    int n;
+
+    if( !dataset_open(&data, DATASETFILE) ) {
+        printf("Failed to open file\n");
+        return;
+    }
+
+    // A small dataset is not worth a thread for every PARSECHUNK bytes
+    n = data.size / PARSECHUNK + 1;
+    if(n > parseThreads) n = parseThreads;
+    parsers = calloc(n, sizeof(struct parser));
+
+    // Split the file at line ends so every chunk starts on a record
+    for(int i = 0; i < n; i++) {
+        parsers[i].chunk = data;
+        parsers[i].chunk.pos = start;
+        // The last chunk runs to the end of the file, so a final record without a line end is kept
+        if(i == n - 1) start = data.size;
+        else start = chunk_end(&data, start, data.size / n * (i + 1));
+        parsers[i].chunk.size = start;
+        parsers[i].queues = calloc(ring.count, sizeof(struct packed_queue));
+    }
+    read_record(&header, &parsers[0].chunk);    // Skip header line
+
+    // The ring does not change while the threads read it
+    for(int i = 1; i < n; i++) {
+        if( pthread_create(&parsers[i].thread, NULL, parse_chunk, &parsers[i]) != 0 )
+            DieWithError( "populate: pthread_create() failed" );
+    }
+    parse_chunk(&parsers[0]);
+    for(int i = 1; i < n; i++) pthread_join(parsers[i].thread, NULL);
+    dataset_close(&data);
+
+    // Insert this process's records and send every other peer its queues, chunk by chunk
+    batch = malloc(sizeof(struct store_batch));
+    for(int i = 0; i < ring.count; i++) {
+        if(i == ring.self) {
+            for(int t = 0; t < n; t++) {
+                for(struct dht_entry* record = parsers[t].own; record != NULL; record = record->next) dht_insert(record);
+            }
+            continue;
+        }
+
+        batch_start( batch, &ring.addr[i] );
+        for(int t = 0; t < n; t++) {
+            struct packed_queue* q = &parsers[t].queues[i];
+            char* packed = q->data;
+
+            for(int j = 0; j < q->count; j++) {
+                batch_add( batch, packed, q->lengths[j] );
+                packed += q->lengths[j];
+            }
+        }
+        batch_finish( batch );
+    }
+    flush_sends();
+
+    for(int t = 0; t < n; t++) {
+        for(int i = 0; i < ring.count; i++) {
+            free(parsers[t].queues[i].data);
+            free(parsers[t].queues[i].lengths);
+        }
+        free(parsers[t].queues);
+        arena_release(&parsers[t].parsed);
+    }
+    free(parsers);
+    free(batch);
+}
+
+size_t chunk_end(struct dataset* data, size_t from, size_t target) {   // Offset of the first line end at or after target that is not inside quotes. from must start a record
+    int quoted = 0;
+
+    for(size_t i = from; i < data->size; i++) {
+        char c = data->data[i];
+
+        if( c == '"' ) quoted = !quoted;     // An escaped quote flips this twice
+        else if( !quoted && i >= target && (c == '\r' || c == '\n') ) return i;
+    }
+    return data->size;
+}
+
+void* parse_chunk(void* arg) {  // Parse a chunk of the dataset, keeping the records this process holds and packing the rest for their holders
+    struct parser* p = arg;
+    struct dht_entry* record = arena_alloc(&p->parsed);
+    int holders[REPLICAMAX];
+
+    while( read_record(record, &p->chunk) ) {
+        int count = ring_replicas(&ring, record->hash, holders), kept = 0;
+
+        for(int r = 0; r < count; r++) {
+            if(holders[r] == ring.self) kept = 1;
+            else pack_record(&p->queues[holders[r]], record);
+        }
+
+        // Records only packed for others reuse their slot
+        if(kept) {
+            record->next = p->own;
+            p->own = record;
+            record = arena_alloc(&p->parsed);
+        }
+    }
+
+    return NULL;
+}
+
+void pack_record(struct packed_queue* q, struct dht_entry* record) {   // Pack record onto the end of q
+    if(q->bytes + ENTRYMAX > q->room) {
+        q->room = q->room ? 2 * q->room : 64 * ENTRYMAX;
+        q->data = realloc(q->data, q->room);
+    }
+    if(q->count == q->lengthRoom) {
+        q->lengthRoom = q->lengthRoom ? 2 * q->lengthRoom : 64;
+        q->lengths = realloc(q->lengths, q->lengthRoom * sizeof(int));
+    }
+    if(q->data == NULL || q->lengths == NULL) DieWithError( "populate: realloc() failed" );
+
+    q->lengths[q->count] = encode_entry(q->data + q->bytes, record);
+    q->bytes += q->lengths[q->count++];
+}
+
+void populate_snapshot(struct snapshot* snap) {    // Send each record of a snapshot to every peer holding it without decoding it
+    struct store_batch* batch = malloc(sizeof(struct store_batch));
+    struct dht_entry record;
+    struct snapshot_index* entry;
+    int* partition = malloc(ring.count * sizeof(int));      // First index entry each process holds in this pass, -1 if none
+    int* next = malloc(snap->header->count * sizeof(int));  // Next index entry with the same holder
+    int holders[REPLICAMAX];
+
+    // Each pass partitions the index by the entries' next holder and sends every partition
+    for(int r = 0; r < ring.replicas; r++) {
+        for(int i = 0; i < ring.count; i++) partition[i] = -1;
+
+        // Walk the index backwards so each partition stays in hash order
+        for(int i = snap->header->count - 1; i >= 0; i--) {
+            if( ring_replicas(&ring, snap->index[i].hash, holders) <= r ) continue;
+            next[i] = partition[holders[r]];
+            partition[holders[r]] = i;
+        }
+
+        for(int i = 0; i < ring.count; i++) {
+            batch_start( batch, &ring.addr[i] );
+
+            for(int j = partition[i]; j >= 0; j = next[j]) {
+                entry = &snap->index[j];
+
+                if(i == ring.self) {
+                    decode_entry(snap->data + entry->offset, &record);
+                    dht_insert(&record);
+                }
+                else batch_add( batch, snap->data + entry->offset, entry->length );     // Already packed for the wire
+            }
+
+            batch_finish( batch );
+        }
+    }
+
+    free(next);
+    free(partition);
+    free(batch);
+    flush_sends();
 }
 
-void populate_dht() {
-    char line[512];
-    char* token;
+void send_partitions(struct dht_entry** partition) {    // Insert this process's partition and send each other one to its peer. partition is indexed like ring.members
+    struct store_batch* batch = malloc(sizeof(struct store_batch));
     struct dht_entry* record;
-    FILE* data = fopen("StatsCountry.csv", "r");
-    if(data == NULL) printf("Failed to open file\n");
-
-    // Parse record info and put into a struct dht_entry
-    read_stats_line(line, data);            // Skip header line
-    while( read_stats_line(line, data) ) {
-        record = calloc(1, sizeof(struct dht_entry));
-
-        token = get_token(line, ",");
-        strcpy(record->countryCode, token);  // Country Code
-        token = get_token(NULL, ",");
-        strcpy(record->shortName, token);    // Short name
-        token = get_token(NULL, ",");
-        strcpy(record->tableName, token);    // Table Name
-        token = get_token(NULL, ",");
-        strcpy(record->longName, token);     // Long Name
-        token = get_token(NULL, ",");
-        strcpy(record->alphaCode, token);    // 2-Alpha Code
-        token = get_token(NULL, ",");
-        strcpy(record->currency, token);     // Currency Unit
-        token = get_token(NULL, ",");
-        strcpy(record->region, token);       // Region
-        token = get_token(NULL, ",");
-        strcpy(record->wbCode, token);       // WB-2 Code
-        token = get_token(NULL, ",");
-        strcpy(record->latestCensus, token); // Latest Population Cansus
-
-        store(record);
-    }
-}
-
-void store(struct dht_entry* record) {
-    int pos = compute_record_pos(record->longName);
-    int nodeID = pos % ring_size;
-    struct store datagram;
-
-    if(id == nodeID) {
-        dht_insert(record, pos);
-    }
-    // Send record to next node in ring.
-    else {
-        datagram.command = 5;
-        datagram.record = *record;
+    char packed[ENTRYMAX];
+
+    for(int i = 0; i < ring.count; i++) {
+        batch_start( batch, &ring.addr[i] );
+
+        for(record = partition[i]; record != NULL; record = record->next) {
+            if(i == ring.self) dht_insert(record);
+            else batch_add( batch, packed, encode_entry(packed, record) );
+        }
 
-        if( sendto( sockSend, &datagram, sizeof(datagram), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(datagram) ) 
-            DieWithError( "store: sendto() sent a different number of bytes than expected" );
+        batch_finish( batch );
+    }
+
+    free(batch);
+    flush_sends();
+}
+
+void batch_start(struct store_batch* batch, struct sockaddr_in* addr) {   // Begin filling STOREs for the peer at addr
+    struct store* header = (struct store*) batch->data;
+    int stream = stream_to(addr);
+
+    batch->addr = *addr;
+    header->command = 5;
+    header->count = 0;
+    header->epoch = ring.epoch;
+    batch->bytes = sizeof(struct store);
+
+    // Pack as many records into each STORE as fit in storeBytes, and in the peer's credit once it has granted any,
+    // leaving room for the stream header in front
+    batch->max = storeBytes;
+    if(streams[stream].credit > 0 && batch->max > (size_t) streams[stream].credit) batch->max = streams[stream].credit;
+    if(batch->max < sizeof(struct stream_header) + sizeof(struct store) + ENTRYMAX) batch->max = sizeof(struct stream_header) + sizeof(struct store) + ENTRYMAX;
+    if(batch->max > BUFFERMAX) batch->max = BUFFERMAX;
+    batch->max -= sizeof(struct stream_header);     // Bounded first, so it cannot wrap
+}
+
+void batch_add(struct store_batch* batch, char* packed, size_t packedBytes) {  // Append a packed record, sending the batch first if it would not fit
+    struct store* header = (struct store*) batch->data;
 
-        free(record);
+    if(batch->bytes + packedBytes > batch->max) {
+        stream_send(batch->data, batch->bytes, &batch->addr);
+        header->count = 0;
+        batch->bytes = sizeof(struct store);
     }
+
+    memcpy(batch->data + batch->bytes, packed, packedBytes);
+    batch->bytes += packedBytes;
+    header->count++;
+    stats.recordsSent++;
 }
 
-void dht_insert(struct dht_entry* record, int pos) {
-    struct dht_entry* head = hashTable[pos];
+void batch_finish(struct store_batch* batch) {  // Send whatever is left in the batch
+    if( ((struct store*) batch->data)->count > 0 ) stream_send(batch->data, batch->bytes, &batch->addr);
+}
 
-    // Insert at head
-    if(head == NULL) hashTable[pos] = record;
-    // Insert into chain
+void store(struct dht_entry* record, unsigned int epoch) {  // Store a copy of record locally or pass it on. epoch is the sender's ring
+    // A sender on a newer ring already found this process to be a holder. Its SET-RING may not have arrived yet
+    if( holds(record->hash) || (int) (epoch - ring.epoch) > 0 ) {
+        // A handoff racing a change of ring can deliver a copy twice
+        if( retrieve_record(record->longName, record->hash) == NULL ) dht_insert(record);
+    }
+    // Send record on towards its owner
     else {
-        while(head->next != NULL) head = head->next;
-    
-        head->next = record;
+        char datagram[sizeof(struct store) + ENTRYMAX];
+        struct store* header = (struct store*) datagram;
+
+        stats.storesForwarded++;
+        header->command = 5;
+        header->count = 1;
+        header->epoch = ring.epoch;
+        stream_send(datagram, sizeof(struct store) + encode_entry(datagram + sizeof(struct store), record), owner_addr(record->hash));
+    }
+}
+
+int holds(uint64_t hash) {  // Whether this process keeps a copy of hash
+    int holders[REPLICAMAX];
+
+    return ring.self != -1 && held_before(&ring, holders, ring_replicas(&ring, hash, holders), &self);
+}
+
+struct sockaddr_in* owner_addr(uint64_t hash) {    // Recv port of the peer owning hash, or the right neighbor before this process has a ring
+    int holders[REPLICAMAX];
+
+    return ring_replicas(&ring, hash, holders) == 0 ? &toAddr : &ring.addr[holders[0]];
+}
+
+struct sockaddr_in* replica_addr(uint64_t hash) {  // Recv port of a peer holding hash, taking each holder in turn to spread reads
+    int holders[REPLICAMAX];
+    int count = ring_replicas(&ring, hash, holders);
+
+    return count == 0 ? &toAddr : &ring.addr[holders[nextReplica++ % count]];
+}
+
+int hand_off(struct dht_user* users, int n) {   // Take up the ring users make up. Copy records to the peers that now hold them, keep the ones this process still holds. Returns number sent
+    struct dht_table old = hashTable;
+    struct ring* oldRing = malloc(sizeof(struct ring));
+    struct dht_entry** partition;
+    int holders[REPLICAMAX], oldHolders[REPLICAMAX];
+    int sent = 0;
+
+    *oldRing = ring;
+    ring.points = NULL;
+    ring_update(users, n);
+
+    if(old.slots != NULL && ring.count > 0) {
+        partition = malloc(ring.count * sizeof(struct dht_entry*));
+        memset(&hashTable, 0, sizeof(hashTable));
+        dht_create();
+
+        // Each pass partitions the records by their next holder. A peer that held a copy already is left out,
+        // and only a record's old owner sends it, so every new holder gets one copy
+        for(int r = 0; r < ring.replicas; r++) {
+            memset(partition, 0, ring.count * sizeof(struct dht_entry*));
+
+            for(int i = 0; i < old.capacity; i++) {
+                struct dht_entry* record = old.slots[i].record;
+                int holder;
+
+                if(record == NULL || ring_replicas(&ring, record->hash, holders) <= r) continue;
+                holder = holders[r];
+
+                if(holder != ring.self) {
+                    int oldCount = ring_replicas(oldRing, record->hash, oldHolders);
+
+                    if(oldCount == 0 || oldHolders[0] != oldRing->self || held_before(oldRing, oldHolders, oldCount, &ring.members[holder])) continue;
+                    sent++;
+                }
+                record->next = partition[holder];
+                partition[holder] = record;
+            }
+
+            send_partitions(partition);
+        }
+
+        arena_release(&old.arena);
+        free(old.slots);
+        free(partition);
+    }
+
+    free(oldRing->points);
+    free(oldRing);
+    return sent;
+}
+
+int await_command(char command, double deadline) {  // Serve the Send and Recv ports until command arrives in msgBuffer, handling anything else meanwhile. Returns 0 if deadline passes first
+    struct pollfd fds[2] = { { sockSend, POLLIN, 0 }, { sockRecv, POLLIN, 0 } };
+    char* carried;
+    int received;
+
+    flush_sends();
+    while(1) {
+        double left = deadline - monotonic_ms();
+
+        if( left <= 0 ) return 0;
+        if( poll(fds, 2, streams_busy() && left > STREAMTIMEOUT ? STREAMTIMEOUT : (int) left + 1) < 0 ) DieWithError( "await: poll() failed" );
+        if( fds[0].revents & POLLIN ) handle_send_port();
+        if( fds[1].revents & POLLIN ) {
+            recvAddrLen = sizeof(recvAddr);
+            if( ( received = recv_counted( sockRecv, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+                DieWithError( "await: recvfrom() failed" );
+
+            // Ring change messages come on streams. Take the awaited one out of its stream header
+            carried = msgBuffer[0] == 25 ? stream_accept(msgBuffer, &recvAddr) : msgBuffer;
+            if( carried != NULL && carried[0] == command ) {
+                memmove(msgBuffer, carried, received - (carried - msgBuffer));
+                flush_sends();
+                return 1;
+            }
+            if( carried != NULL ) recv_port_command(carried, &recvAddr);
+        }
+        resend_streams();
+        flush_sends();
+    }
+}
+
+void stream_send(void* msg, int size, struct sockaddr_in* addr) {   // Add a message to the stream to addr. It is sent once the window has room
+    int i = stream_to(addr);
+    struct stream* s = &streams[i];
+    struct stream_msg* entry = malloc(sizeof(struct stream_msg) + sizeof(struct stream_header) + size);
+    struct stream_header* header = (struct stream_header*) entry->data;
+
+    entry->seq = s->next++;
+    entry->size = sizeof(struct stream_header) + size;
+    entry->next = NULL;
+    header->command = 25;
+    header->seq = entry->seq;
+    memcpy(entry->data + sizeof(struct stream_header), msg, size);
+
+    if(s->tail == NULL) s->head = entry;
+    else s->tail->next = entry;
+    s->tail = entry;
+
+    stream_push(s);
+}
+
+int stream_to(struct sockaddr_in* addr) {   // Index in streams of the stream to addr, starting one if there is none
+    for(int i = 0; i < streamCount; i++) {
+        if( streams[i].addr.sin_port == addr->sin_port && streams[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr ) return i;
+    }
+
+    streams = realloc(streams, (streamCount + 1) * sizeof(struct stream));
+    memset(&streams[streamCount], 0, sizeof(struct stream));
+    streams[streamCount].addr = *addr;
+    return streamCount++;
+}
+
+int stream_from(struct sockaddr_in* addr) {     // Index in inStreams of the stream from addr, starting one if there is none
+    for(int i = 0; i < inStreamCount; i++) {
+        if( inStreams[i].addr.sin_port == addr->sin_port && inStreams[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr ) return i;
+    }
+
+    inStreams = realloc(inStreams, (inStreamCount + 1) * sizeof(struct stream_in));
+    inStreams[inStreamCount].addr = *addr;
+    inStreams[inStreamCount].expected = 0;
+    inStreams[inStreamCount].lastAt = 0;
+    return inStreamCount++;
+}
+
+char* stream_accept(char* msg, struct sockaddr_in* from) {   // Take a stream message if it is the next one from its sender, and acknowledge. Returns what it carries, or NULL if it is not taken
+    struct stream_header* header = (struct stream_header*) msg;
+    int stream = stream_from(from);
+    struct stream_in* in = &inStreams[stream];
+    struct store_ack ack;
+    int taken;
+
+    // The sender gave up on any messages before base, so they will not come
+    if( (int) (header->base - in->expected) > 0 ) in->expected = header->base;
+
+    in->lastAt = monotonic_ms();
+
+    // Take messages in order. Any other repeats one already taken or follows a lost one the sender will send again
+    taken = header->seq == in->expected;
+    if( taken ) in->expected++;
+
+    // Acknowledge every message taken so far, from the Recv port so the sender can tell which stream it is for
+    ack.command = 24;
+    ack.next = in->expected;
+    ack.credit = store_credit();
+    queue_send( sockRecv, &ack, sizeof(ack), from );
+
+    return taken ? msg + sizeof(struct stream_header) : NULL;
+}
+
+void stream_push(struct stream* s) {    // Send every message of the stream that has not been sent and fits in the window and the peer's credit
+    struct stream_msg* entry = s->head;
+
+    if(entry != NULL && entry->seq == s->unsent) s->sentAt = monotonic_ms();    // Nothing was in flight, so start the timer
+
+    while( entry != NULL && entry->seq != s->unsent ) entry = entry->next;
+    for( ; entry != NULL && entry->seq - s->head->seq < STREAMWINDOW; entry = entry->next ) {
+        if( s->inFlight > 0 && s->inFlight + entry->size > s->credit ) break;
+
+        stream_transmit(s, entry);
+        s->unsent = entry->seq + 1;
+        s->inFlight += entry->size;
+    }
+}
+
+void stream_transmit(struct stream* s, struct stream_msg* entry) {   // Queue one message of the stream
+    ((struct stream_header*) entry->data)->base = s->head->seq;
+    queue_send( sockSend, entry->data, entry->size, &s->addr );
+}
+
+void ack_stream(struct store_ack* ack, struct sockaddr_in* from) {  // Drop every message the peer has acknowledged and send what now fits in the window
+    int i = stream_to(from);
+    struct stream* s = &streams[i];
+    struct stream_msg* entry;
+
+    // Ignore acknowledgements that claim messages not sent yet
+    if( s->head == NULL || (int) (ack->next - s->unsent) > 0 ) return;
+
+    // A repeated acknowledgement acknowledges nothing new, but its credit is still current
+    s->credit = ack->credit;
+    if( (int) (ack->next - s->head->seq) > 0 ) {
+        while( s->head != NULL && (int) (ack->next - s->head->seq) > 0 ) {
+            entry = s->head;
+            s->head = entry->next;
+            s->inFlight -= entry->size;
+            free(entry);
+        }
+        if(s->head == NULL) s->tail = NULL;
+
+        s->sentAt = monotonic_ms();
+        s->timeouts = 0;
+    }
+    stream_push(s);
+}
+
+void resend_streams() {     // Go back to the oldest unacknowledged message of every stream that has waited too long and send the window again
+    double now = monotonic_ms();
+
+    for(int i = 0; i < streamCount; i++) {
+        struct stream* s = &streams[i];
+        struct stream_msg* entry;
+
+        if( s->head == NULL || now - s->sentAt < STREAMTIMEOUT ) continue;
+
+        // Give up on a peer that has stopped answering rather than wait on it forever
+        if( ++s->timeouts > STREAMRETRIES ) {
+            printf("No acknowledgement from port %d, dropped %u messages\n", ntohs(s->addr.sin_port), s->next - s->head->seq);
+            while( (entry = s->head) != NULL ) {
+                s->head = entry->next;
+                free(entry);
+            }
+            s->tail = NULL;
+            s->unsent = s->next;
+            s->inFlight = 0;
+            s->timeouts = 0;
+            continue;
+        }
+
+        for(entry = s->head; entry != NULL && entry->seq != s->unsent; entry = entry->next) {
+            stream_transmit(s, entry);
+            stats.storesResent++;
+        }
+        s->sentAt = now;
+    }
+    finish_handoff();
+}
+
+int store_credit() {    // Bytes of STOREs each peer sending to this process may have in flight: an even share of the Recv buffer
+    double now = monotonic_ms();
+    int senders = 0;
+
+    for(int i = 0; i < inStreamCount; i++) {
+        if( now - inStreams[i].lastAt < CREDITIDLE ) senders++;
+    }
+
+    return recvBuffer / (senders > 0 ? senders : 1);
+}
+
+int streams_busy() {    // Whether any stream message this process sent is still unacknowledged
+    for(int i = 0; i < streamCount; i++) {
+        if( streams[i].head != NULL ) return 1;
+    }
+    return 0;
+}
+
+void drain_streams() {  // Serve the Send and Recv ports until every stream message this process sent is acknowledged or given up on
+    struct pollfd fds[2] = { { sockSend, POLLIN, 0 }, { sockRecv, POLLIN, 0 } };
+
+    flush_sends();
+    while( streams_busy() ) {
+        if( poll(fds, 2, STREAMTIMEOUT) < 0 ) DieWithError( "drain: poll() failed" );
+        if( fds[0].revents & POLLIN ) handle_send_port();
+        if( fds[1].revents & POLLIN ) handle_recv_port();
+        resend_streams();
+        flush_sends();
+    }
+}
+
+void finish_handoff() {     // Tell the joining peer a handoff is over once every STORE this process sent is acknowledged
+    if( handoffAck.sin_port == 0 || streams_busy() ) return;
+
+    stream_send( &handoffDone, sizeof(handoffDone), &handoffAck );
+    handoffAck.sin_port = 0;
+}
+
+void queue_send(int sock, void* datagram, int size, struct sockaddr_in* addr) {    // Send a datagram with the next flush_sends()
+    count_bytes( sock, stats.bytesOut, size );
+    if( outbox_add( &outbox, sock, datagram, size, addr ) < 0 )
+        DieWithError( "queue_send: sendmmsg() sent a different number of bytes than expected" );
+}
+
+void flush_sends() {    // Send every queued datagram
+    if( outbox_flush( &outbox ) < 0 )
+        DieWithError( "flush_sends: sendmmsg() sent a different number of bytes than expected" );
+}
+
+void dht_create() {     // Creates an empty local hash table
+    hashTable.capacity = TABLESIZE;
+    hashTable.count = 0;
+    hashTable.slots = calloc(TABLESIZE, sizeof(struct dht_slot));
+}
+
+void dht_insert(struct dht_entry* record) {    // Copies record into the table's arena
+    struct dht_entry* copy = retrieve_record(record->longName, record->hash);
+    struct dht_slot entry;
+
+    if( hashTable.capacity == 0 ) dht_create();
+
+    // Same long name is already stored; keep the newer copy
+    if(copy != NULL) {
+        *copy = *record;
+        copy->next = NULL;
+        return;
     }
 
-    //printf("Inserted: %s, %s\n", record->countryCode, record->longName);
+    copy = arena_alloc(&hashTable.arena);
+    *copy = *record;
+    copy->next = NULL;
+    entry.hash = copy->hash;
+    entry.record = copy;
+
+    // Keep the load factor under 7/8
+    if( (hashTable.count + 1) * 8 > hashTable.capacity * 7 ) dht_resize(hashTable.capacity * 2);
+
+    dht_place(entry);
+}
+
+void dht_place(struct dht_slot entry) {     // Robin Hood insertion: take the slot of any record closer to its home slot
+    unsigned int mask = hashTable.capacity - 1;
+    unsigned int i = entry.hash & mask;
+    unsigned int dist = 0, slotDist;
+    struct dht_slot tmp;
+
+    while(1) {
+        struct dht_slot* slot = &hashTable.slots[i];
+
+        // Empty slot
+        if(slot->record == NULL) {
+            *slot = entry;
+            hashTable.count++;
+            return;
+        }
+        // Displace a record that is closer to home than this one
+        slotDist = (i - slot->hash) & mask;
+        if(slotDist < dist) {
+            tmp = *slot;
+            *slot = entry;
+            entry = tmp;
+            dist = slotDist;
+        }
+
+        i = (i + 1) & mask;
+        dist++;
+    }
 }
 
-int compute_record_pos(char* name) {
-    int sum = 0;
+void dht_resize(int capacity) {     // Moves every record into a table with the given number of slots
+    struct dht_slot* old = hashTable.slots;
+    int oldCapacity = hashTable.capacity;
 
-    for(int i = 0; i < strlen(name); i++) {
-        sum += name[i];
+    hashTable.capacity = capacity;
+    hashTable.count = 0;
+    hashTable.slots = calloc(capacity, sizeof(struct dht_slot));
+
+    for(int i = 0; i < oldCapacity; i++) {
+        if(old[i].record != NULL) dht_place(old[i]);
     }
 
-    return sum % 353;
+    free(old);
 }
 
 void print_record(struct dht_entry record) {
@@ -819,77 +1691,450 @@ void print_record(struct dht_entry record) {
 }
 
 void process_query(struct query* query) {
-    int pos = compute_record_pos(query->longName);
-    int nodeId = pos % ring_size;
     struct dht_entry* record;
     struct query_success mesg;
     struct sockaddr_in addr = query->requesterAddr;
 
-    // Record is in this node
-    if(nodeId == id) {
-        record = retrieve_record(query->longName, pos);
+    trace_hop(query);
+
+    // A copy of the record is in this node
+    if( holds(query->hash) ) {
+        record = retrieve_record(query->longName, query->hash);
+        stats.queriesAnswered++;
 
         // Record not found; return failure
         if(record == NULL) {
-            if( sendto( sockQuery, "FAILURE\n\0", 9, 0, (struct sockaddr *) &addr, sizeof( addr ) ) != 9 )
-                DieWithError( "query failure: sendto() sent a different number of bytes than expected" );    
+            struct query_failure failure;
+
+            stats.queriesMissing++;
+            failure.command = 20;
+            failure.requestId = query->requestId;
+            attach_trace((char*) failure.path, query, &failure.hops);
+            queue_send( sockQuery, &failure, QUERY_FAILURE_SIZE(&failure), &addr );
         }
         // Send record to requester
         else {
+            int packed = encode_entry(mesg.record, record);
+            int size = offsetof(struct query_success, record) + packed;
             mesg.command = 8;
-            mesg.record = copy_record(record);
+            mesg.requestId = query->requestId;
+            mesg.hops = 0;
+
+            // Let the entry peer answer the next query for this name itself
+            if( query->entryAddr.sin_port != queryAddr.sin_port || query->entryAddr.sin_addr.s_addr != queryAddr.sin_addr.s_addr )
+                queue_send( sockSend, &mesg, size, &query->entryAddr );
 
-            if( sendto( sockQuery, &mesg, sizeof(mesg), 0, (struct sockaddr *) &addr, sizeof( addr ) ) != sizeof(mesg) )
-                DieWithError( "query success: sendto() sent a different number of bytes than expected" );    
+            queue_send( sockQuery, &mesg, size + attach_trace(mesg.record + packed, query, &mesg.hops), &addr );
         }
     }
-    // Record is not in this node; continue to next node
+    // Record is not in this node; forward it straight to one of the peers holding it
     else {
-        if( sendto( sockSend, query, sizeof(struct query), 0, (struct sockaddr *) &toAddr, sizeof( toAddr ) ) != sizeof(struct query) )
-            DieWithError( "query: sendto() sent a different number of bytes than expected" );  
+        stats.queriesForwarded++;
+        queue_send( sockSend, query, QUERY_SIZE(query), replica_addr(query->hash) );
     }
 }
 
-struct dht_entry* retrieve_record(char* name, int pos) {
-    struct dht_entry* node = hashTable[pos];
+struct dht_entry* retrieve_record(char* name, uint64_t hash) {
+    unsigned int mask = hashTable.capacity - 1;
+    unsigned int i = hash & mask;
+    unsigned int dist = 0;
+
+    if(hashTable.capacity == 0) return NULL;
 
     while(1) {
-        if(node == NULL) return NULL;
-        if(strcmp(name, node->longName) == 0) return node;
-        node = node->next;
+        struct dht_slot* slot = &hashTable.slots[i];
+
+        // Reached an empty slot or a record closer to home than this one would be; name is not stored
+        if(slot->record == NULL || ((i - slot->hash) & mask) < dist) return NULL;
+        if(slot->hash == hash && strcmp(name, slot->record->longName) == 0) return slot->record;
+
+        i = (i + 1) & mask;
+        dist++;
     }
+}
 
-    return NULL;
+void delete_dht() {     //Deletes local hash table and every record in it
+    arena_release(&hashTable.arena);
+    free(hashTable.slots);
+    memset(&hashTable, 0, sizeof(hashTable));
+
+    // Leave the ring with the table, so a STORE arriving late is not taken as held here
+    ring.count = 0;
+    ring.pointCount = 0;
+    ring.self = -1;
+    ring.epoch++;
+}
+
+struct dht_entry* arena_alloc(struct dht_arena* arena) {    // Returns a zeroed record from the arena's current slab
+    struct dht_slab* slab = arena->slabs;
+
+    if(slab == NULL || slab->used == ARENASLAB) {
+        slab = malloc(sizeof(struct dht_slab));
+        slab->next = arena->slabs;
+        slab->used = 0;
+        arena->slabs = slab;
+    }
+
+    memset(&slab->record[slab->used], 0, sizeof(struct dht_entry));
+    return &slab->record[slab->used++];
+}
+
+void arena_release(struct dht_arena* arena) {   // Frees every record in the arena at once
+    struct dht_slab* slab;
+
+    while(arena->slabs != NULL) {
+        slab = arena->slabs;
+        arena->slabs = slab->next;
+        free(slab);
+    }
+}
+
+void query_batch(char* username, char* file) {   // Resolve each long name in file, or typed on stdin up to an empty line, with many queries in flight
+    struct query_dht datagram;
+    struct query_dht* response;
+    struct sockaddr_in entry;
+    struct pending_query pending[QUERYWINDOW];
+    FILE* in = stdin;
+    char line[256];
+    size_t length;
+    int inFlight = 0, more = 1, found = 0, missing = 0, unanswered = 0;
+    double start;
+
+    if( file != NULL && (in = fopen(file, "r")) == NULL ) {
+        perror( "query-batch: fopen() failed" );
+        return;
+    }
+
+    // Ask the server for the entry peer, once for the whole batch
+    datagram.command = 6;
+    strcpy( datagram.user_name, username );
+    if( send_counted( sockServ, &datagram, sizeof(datagram), 0, (struct sockaddr *) &servAddr, sizeof( servAddr ) ) != sizeof(datagram) ) 
+        DieWithError( "query-batch: sendto() sent a different number of bytes than expected" );
+    if( ( recv_counted( sockServ, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &recvAddr, &recvAddrLen )) < 0 ) 
+        DieWithError( "query-batch: recvfrom() failed" );
+
+    if( strcmp(msgBuffer, "FAILURE\n") == 0 ) {
+        printf("%s", (char *) msgBuffer);
+        if( in != stdin ) fclose(in);
+        return;
+    }
+    response = (struct query_dht*) msgBuffer;
+    fill_addr(&entry, response->ipAddr, response->portQuery);
+
+    // Slot i sends request IDs i, i + QUERYWINDOW, i + 2 * QUERYWINDOW, ... so an answer finds its slot directly
+    for(int i = 0; i < QUERYWINDOW; i++) {
+        pending[i].active = 0;
+        pending[i].query.requestId = i - QUERYWINDOW;
+    }
+
+    start = monotonic_ms();
+    while( more || inFlight > 0 ) {
+        struct pollfd fds[2] = { { sockQuery, POLLIN, 0 }, { fileno(in), POLLIN, 0 } };
+        int reading = more && inFlight < QUERYWINDOW;
+        double now = monotonic_ms(), wait = -1;
+
+        // Top up the window. A file is read ahead freely, stdin only when a line is waiting
+        while( reading && (in != stdin || poll(&fds[1], 1, 0) > 0) ) {
+            struct pending_query* p = pending;
+
+            if( fgets(line, sizeof(line), in) == NULL ) {
+                more = 0;
+                break;
+            }
+            length = strcspn(line, "\r\n");
+            if( line[length] == '\0' && !feof(in) ) {     // Longer than line: drop the rest of it
+                int c;
+                while( (c = fgetc(in)) != EOF && c != '\n' );
+            }
+            line[length] = '\0';
+            if( line[0] == '\0' ) {    // An empty line ends stdin; a file may have blank lines
+                if( in != stdin ) continue;
+                more = 0;
+                break;
+            }
+            if( length >= sizeof(pending[0].query.longName) ) {
+                printf("query-batch: skipping a name longer than %d characters\n", (int) sizeof(pending[0].query.longName) - 1);
+                continue;
+            }
+
+            while( p->active ) p++;
+            p->query.command = 7;
+            p->query.requesterAddr = queryAddr;
+            p->query.requestId += QUERYWINDOW;
+            strcpy(p->query.longName, line);
+            p->query.nameLength = strlen(p->query.longName) + 1;
+            p->query.hash = hash_name(p->query.longName);
+            p->active = 1;
+            p->tries = 0;
+            send_pending(p, &entry);
+
+            reading = ++inFlight < QUERYWINDOW;
+        }
+        flush_sends();
+
+        // Sleep until an answer arrives, a query times out or, with room in the window, stdin has a line
+        for(int i = 0; i < QUERYWINDOW; i++) {
+            double left = pending[i].sentAt + QUERYTIMEOUT - now;
+
+            if( pending[i].active && (wait < 0 || left < wait) ) wait = left > 0 ? left : 0;
+        }
+        if( !more && inFlight == 0 ) break;
+        if( poll(fds, reading && in == stdin ? 2 : 1, wait < 0 ? -1 : (int) wait + 1) < 0 )
+            DieWithError( "query-batch: poll() failed" );
+
+        // Print answers as they come in
+        if( fds[0].revents & POLLIN ) {
+            int received = inbox_receive( &inbox, sockQuery, MSG_DONTWAIT );
+
+            for(int i = 0; i < received; i++) {
+                char* msg = inbox.data[i];
+                unsigned int requestId;
+                struct pending_query* p;
+
+                count_bytes( sockQuery, stats.bytesIn, inbox.msgs[i].msg_len );
+                if( msg[0] == 8 ) requestId = ((struct query_success*) msg)->requestId;
+                else if( msg[0] == 20 ) requestId = ((struct query_failure*) msg)->requestId;
+                else continue;
+
+                // Ignore answers to queries already answered or given up on
+                p = &pending[requestId % QUERYWINDOW];
+                if( !p->active || p->query.requestId != requestId ) continue;
+                p->active = 0;
+                inFlight--;
+
+                print_reply(msg, p->query.longName, monotonic_ms());
+                if( msg[0] == 8 ) found++;
+                else missing++;
+            }
+        }
+
+        // Send again any query whose answer is overdue
+        now = monotonic_ms();
+        for(int i = 0; i < QUERYWINDOW; i++) {
+            struct pending_query* p = &pending[i];
+
+            if( !p->active || now - p->sentAt < QUERYTIMEOUT ) continue;
+            if( p->tries < QUERYRETRIES ) send_pending(p, &entry);
+            else {
+                printf("No answer for %s\n", p->query.longName);
+                p->active = 0;
+                inFlight--;
+                unanswered++;
+            }
+        }
+        flush_sends();
+    }
+
+    printf("Batch done: %d found, %d not found, %d unanswered in %.1f ms\n", found, missing, unanswered, monotonic_ms() - start);
+    if( in != stdin ) fclose(in);
+}
+
+void send_pending(struct pending_query* p, struct sockaddr_in* entry) {   // Queue a batch query to the entry peer and restart its timer
+    start_trace(&p->query);
+    queue_send( sockQuery, &p->query, QUERY_SIZE(&p->query), entry );
+    p->sentAt = monotonic_ms();
+    p->tries++;
+}
+
+double monotonic_ms() {     // Milliseconds on a clock that never jumps
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+void trace_hop(struct query* query) {   // Record this process in a traced query's path
+    if( query->trace && query->hops < TRACEMAX ) {
+        query->path[query->hops].id = id;
+        query->path[query->hops].at = monotonic_ms();
+        query->hops++;
+    }
+}
+
+void start_trace(struct query* query) {     // Begin a query's path at the requester, if tracing is on
+    query->trace = traceQueries;
+    query->hops = 0;
+    trace_hop(query);
+    if( query->trace ) query->path[0].id = -1;
+}
+
+int attach_trace(char* end, struct query* query, unsigned char* hops) {    // Copy a query's path to the end of its reply. Returns bytes added
+    *hops = query->trace ? query->hops : 0;
+    memcpy(end, query->path, *hops * sizeof(struct hop));
+
+    return *hops * sizeof(struct hop);
 }
 
-struct dht_entry copy_record(struct dht_entry* record) {
-    struct dht_entry copy;
+void print_reply(char* msg, char* name, double received) {     // Print a QUERY-SUCCESS or QUERY-FAILURE and any path it carries
+    struct hop path[TRACEMAX];
+    struct dht_entry record;
+    int hops;
+
+    if( msg[0] == 8 ) {
+        struct query_success* reply = (struct query_success*) msg;
+        int packed = decode_entry(reply->record, &record);
+
+        print_record(record);
+        hops = reply->hops;
+        memcpy(path, reply->record + packed, hops * sizeof(struct hop));
+    }
+    else {
+        struct query_failure* reply = (struct query_failure*) msg;
 
-    strcpy(copy.countryCode, record->countryCode);
-    strcpy(copy.shortName, record->shortName);
-    strcpy(copy.tableName, record->tableName);
-    strcpy(copy.longName, record->longName);
-    strcpy(copy.alphaCode, record->alphaCode);
-    strcpy(copy.currency, record->currency);
-    strcpy(copy.region, record->region);
-    strcpy(copy.wbCode, record->wbCode);
-    strcpy(copy.latestCensus, record->latestCensus);
+        printf("Record associated with %s not found\n", name);
+        hops = msg[0] == 20 ? reply->hops : 0;
+        memcpy(path, reply->path, hops * sizeof(struct hop));
+    }
 
-    return copy;
+    // Times are relative to when the requester sent the query, so they only line up for processes on one host
+    if( hops > 0 ) {
+        printf("Trace of %s: %d ring hops\n", name, hops - 2 > 0 ? hops - 2 : 0);
+        for(int i = 1; i < hops; i++) printf("  node %d at +%.3f ms\n", path[i].id, path[i].at - path[0].at);
+        printf("  reply at +%.3f ms\n", received - path[0].at);
+    }
 }
 
-void delete_dht() {     //Deletes local hash table
-    for(int i = 0; i < 353; i++) {
-        delete_dht_list(hashTable[i]);
+void fill_stats(struct peer_stats* out) {   // Copy the counters and measure the hash table
+    stats.id = id;
+    stats.ringSize = ring_size;
+    stats.recordsStored = hashTable.count;
+    stats.tableCapacity = hashTable.capacity;
+    stats.recvBuffer = recvBuffer;
+    memset(stats.probeHistogram, 0, sizeof(stats.probeHistogram));
+
+    for(int i = 0; i < hashTable.capacity; i++) {
+        if( hashTable.slots[i].record != NULL ) {
+            int distance = (i - hashTable.slots[i].hash) & (hashTable.capacity - 1);
+
+            stats.probeHistogram[distance < 15 ? distance : 15]++;
+        }
     }
 
-    free(hashTable);
+    *out = stats;
+}
+
+void print_stats(struct peer_stats* s) {
+    char* sockets[SOCKETKINDS] = { "server", "send", "recv", "query" };
+
+    printf("ID: %d, Ring Size: %d\n", s->id, s->ringSize);
+    printf("Records stored    : %d in %d slots\n", s->recordsStored, s->tableCapacity);
+    printf("Queries answered  : %llu (%llu not found)\n", (unsigned long long) s->queriesAnswered, (unsigned long long) s->queriesMissing);
+    printf("Cache hits        : %llu\n", (unsigned long long) s->cacheHits);
+    printf("Queries forwarded : %llu\n", (unsigned long long) s->queriesForwarded);
+    printf("STOREs forwarded  : %llu\n", (unsigned long long) s->storesForwarded);
+    printf("Records sent      : %llu\n", (unsigned long long) s->recordsSent);
+    printf("STOREs resent     : %llu\n", (unsigned long long) s->storesResent);
+    printf("Recv buffer       : %d bytes\n", s->recvBuffer);
+    printf("populate_dht      : %d calls, %.1f ms in total, %.1f ms last\n", s->populateCalls, s->populateMs, s->lastPopulateMs);
+    for(int i = 0; i < SOCKETKINDS; i++) {
+        printf("%-6s socket     : %llu bytes in, %llu bytes out\n", sockets[i], (unsigned long long) s->bytesIn[i], (unsigned long long) s->bytesOut[i]);
+    }
+    printf("Records by distance from home slot:\n");
+    for(int i = 0; i < 16; i++) {
+        if(s->probeHistogram[i] > 0) printf("  %2d%s: %u\n", i, i == 15 ? "+" : " ", s->probeHistogram[i]);
+    }
 }
 
-void delete_dht_list(struct dht_entry* chain) {  // Deletes chain from hash table
-    if(chain == NULL) return;
-    delete_dht_list(chain->next);
-    free(chain);
+void count_bytes(int sock, uint64_t* counters, ssize_t bytes) {    // Add to the counter for the socket's kind
+    if( bytes <= 0 ) return;
+
+    if( sock == sockQuery ) counters[QUERY_SOCKET] += bytes;
+    else if( sock == sockRecv ) counters[RECV_SOCKET] += bytes;
+    else if( sock == sockServ ) counters[SERV_SOCKET] += bytes;
+    else counters[SEND_SOCKET] += bytes;
+}
+
+ssize_t send_counted(int sock, const void* buf, size_t len, int flags, const struct sockaddr* addr, socklen_t addrLen) {   // sendto that counts bytes out
+    ssize_t sent = sendto( sock, buf, len, flags, addr, addrLen );
+
+    count_bytes( sock, stats.bytesOut, sent );
+    return sent;
+}
+
+ssize_t recv_counted(int sock, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addrLen) {    // recvfrom that counts bytes in
+    ssize_t received = recvfrom( sock, buf, len, flags, addr, addrLen );
+
+    count_bytes( sock, stats.bytesIn, received );
+    return received;
+}
+
+void cache_create(int capacity) {   // Allocates an empty cache of the given number of entries
+    cache.capacity = capacity;
+    cache.entries = malloc(capacity * sizeof(struct cache_entry));
+    cache.bucketCount = 1;
+    while(cache.bucketCount < capacity) cache.bucketCount *= 2;
+    cache.buckets = malloc(cache.bucketCount * sizeof(struct cache_entry*));
+    cache_clear();
+}
+
+struct cache_entry* cache_lookup(char* name, uint64_t hash) {  // Returns the cached reply for a long name and marks it most recently used
+    struct cache_entry* e;
+
+    if(cache.capacity == 0) return NULL;
+
+    e = cache.buckets[hash & (cache.bucketCount - 1)];
+    while(e != NULL && (e->hash != hash || strcmp(e->longName, name) != 0)) e = e->next;
+
+    if(e != NULL && e != cache.newest) {
+        cache_unlink(e);
+        cache_push(e);
+    }
+
+    return e;
+}
+
+void cache_insert(struct query_success* reply) {   // Caches a reply, replacing the least recently used one when full
+    struct dht_entry record;
+    struct cache_entry* e;
+    struct cache_entry** link;
+    int size = offsetof(struct query_success, record) + decode_entry(reply->record, &record);
+
+    if(cache.capacity == 0 || cache_lookup(record.longName, record.hash) != NULL) return;
+
+    if(cache.count < cache.capacity) e = &cache.entries[cache.count++];
+    else {
+        e = cache.oldest;
+        cache_unlink(e);
+
+        // Remove from its bucket
+        link = &cache.buckets[e->hash & (cache.bucketCount - 1)];
+        while(*link != e) link = &(*link)->next;
+        *link = e->next;
+    }
+
+    e->hash = record.hash;
+    strcpy(e->longName, record.longName);
+    e->size = size;
+    memcpy(&e->reply, reply, size);
+
+    link = &cache.buckets[e->hash & (cache.bucketCount - 1)];
+    e->next = *link;
+    *link = e;
+    cache_push(e);
+}
+
+void cache_clear() {    // Forgets every cached reply
+    cache.count = 0;
+    cache.newest = NULL;
+    cache.oldest = NULL;
+    memset(cache.buckets, 0, cache.bucketCount * sizeof(struct cache_entry*));
+}
+
+void cache_unlink(struct cache_entry* e) {  // Removes an entry from the order of use
+    if(e->newer != NULL) e->newer->older = e->older;
+    else cache.newest = e->older;
+
+    if(e->older != NULL) e->older->newer = e->newer;
+    else cache.oldest = e->newer;
+}
+
+void cache_push(struct cache_entry* e) {    // Makes an entry the most recently used
+    e->newer = NULL;
+    e->older = cache.newest;
+
+    if(cache.newest != NULL) cache.newest->newer = e;
+    else cache.oldest = e;
+    cache.newest = e;
 }
 
 
@@ -1,18 +1,41 @@
 #include "defn.h" 
+#include <time.h>
 
 // Declarations
-struct user* user_register(struct user_register*, struct user*);
-int check_user_unique(struct user*, struct user*);
-int deregister( char*, struct user**);
-struct user* find_user(char*, struct user*);
-struct user* get_user(struct user*, int);
+struct user* user_register(struct user_register*, struct registry*);
+int check_user_unique(struct user*, struct registry*);
+int deregister( char*, struct registry*);
+struct user* find_user(char*, struct registry*);
+struct user* find_in_bucket(char*, struct registry*);
+struct user* get_user(struct registry*, int);
 struct dht_user create_dht_user(struct user*);
 int is_in(char* name, struct dht_user*, int);
-struct user* create_rand_list( struct user*, int, struct dht_user*, int);
-struct user* get_random_user(struct user*, int);
-struct user* get_leader(struct user*);
-int get_ring_size(struct user*);
-void set_free(struct user*);
+struct user* create_rand_list( struct registry*, int, struct dht_user*);
+struct user* get_random_user(struct registry*);
+struct user* get_leader(struct registry*);
+int get_ring_size(struct registry*);
+void set_state(struct registry*, struct user*, State);
+void set_free(struct registry*);
+int claim_ports(struct registry*, struct user*);
+void mark_ports(struct registry*, struct user*, int);
+void pool_add(struct registry*, struct user*);
+void pool_remove(struct registry*, struct user*);
+int random_below(int);
+void* worker(void*);
+void handle_command(int, char*, struct sockaddr_in);
+void reply(int, void*, int, struct sockaddr_in);
+
+struct worker {         // A server thread and the socket it serves
+    int sock;
+    uint64_t seed;
+};
+
+struct registry* registry;      // Registered users
+int dhtCreated = 0;             // 0: no dht, 1: dht is setup, 2: dht is being setup
+char user_tmp[16];              // Temporary storage of a username
+pthread_rwlock_t dhtLock = PTHREAD_RWLOCK_INITIALIZER;    // Held for writing by commands that change DHT state
+__thread uint64_t rngState;     // State of each thread's xorshift64* generator used to pick users
+__thread struct outbox* outbox; // Replies waiting to be sent by this thread
 
 // Utility functions
 void DieWithError( const char *errorMessage ) // External error handling function
@@ -21,18 +44,21 @@ void DieWithError( const char *errorMessage ) // External error handling functio
     exit( 1 );
 }
 
+void reply(int sock, void* data, int size, struct sockaddr_in clntAddr) {    // Queue a datagram for the client, sent when this batch of commands is done
+    if( outbox_add(outbox, sock, data, size, &clntAddr) < 0 )
+        DieWithError( "reply: sendmmsg() sent a different number of bytes than expected" );
+}
+
 void success(int sock, struct sockaddr_in clntAddr) {   // Returns success to client
     //char* s = "SUCCESS\n\0";
 
-    if( sendto( sock, "SUCCESS\n\0", 9, 0, (struct sockaddr *) &clntAddr, sizeof( clntAddr ) ) != 9 )  // Send datagram to server
-        DieWithError( "success: sendto() sent a different number of bytes than expected" );    
+    reply(sock, "SUCCESS\n\0", 9, clntAddr);
 }
 
 void failure(int sock, struct sockaddr_in clntAddr) {   // Returns failure to client
     //char* s = "FAILURE\n\0";
 
-    if( sendto( sock, "FAILURE\n\0", 9, 0, (struct sockaddr *) &clntAddr, sizeof( clntAddr ) ) != 9 )  // Send datagram to server
-        DieWithError( "failure: sendto() sent a different number of bytes than expected" );    
+    reply(sock, "FAILURE\n\0", 9, clntAddr);
 }
 
 void get_line(char* buffer, int len, FILE* in) {    // Modification of fgets that removes trailing newlines
@@ -45,29 +71,32 @@ void get_line(char* buffer, int len, FILE* in) {    // Modification of fgets tha
 // Main method
 int main( int argc, char *argv[] )
 {
-    int sock;                        // Socket
     struct sockaddr_in ServAddr;     // Local address of server
-    struct sockaddr_in ClntAddr;     // Client address
-    unsigned int cliAddrLen;         // Length of incoming message
     unsigned short ServPort;         // Server port
-    char msgBuffer[ BUFFERMAX ];     // Buffer for received datagrams
-    int dhtCreated = 0;              // 0: no dht, 1: dht is setup, 2: dht is being setup
-
-    struct user* user_list = NULL;   // List of registered users
-    int users = 0;                   // Size of user_list
-    char user_tmp[16];               // Temporary storage of a username
+    int threads = 1;                 // Number of worker threads, each with its own socket
+    pthread_t thread[ WORKERMAX ];
+    struct worker workers[ WORKERMAX ];
+    uint64_t seed;
+    int opt;
+
+    seed = time(NULL) ^ ((uint64_t) getpid() << 32);
+    while( (opt = getopt(argc, argv, "r:t:")) != -1 ) {    // Read options
+        if( opt == 'r' ) seed = strtoull(optarg, NULL, 10);
+        else if( opt == 't' ) threads = atoi(optarg);
+        else argc = 0;
+    }
 
-    if( argc != 2 )         // Test for correct number of parameters
+    if( argc - optind != 1 || threads < 1 || threads > WORKERMAX )         // Test for correct number of parameters
     {
-        fprintf( stderr, "Usage:  %s <UDP SERVER PORT>\n", argv[ 0 ] );
+        fprintf( stderr, "Usage:  %s [-r random seed] [-t worker threads] <UDP SERVER PORT>\n", argv[ 0 ] );
         exit( 1 );
     }
 
-    ServPort = atoi(argv[1]);  // First arg: local port
+    ServPort = atoi(argv[optind]);  // First arg: local port
 
-    // Create socket for sending/receiving datagrams
-    if( ( sock = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
-        DieWithError( "server: socket() failed" );
+    registry = calloc(1, sizeof(struct registry));
+    for(int i = 0; i < NAMESHARDS; i++) pthread_mutex_init(&registry->nameLocks[i], NULL);
+    pthread_mutex_init(&registry->poolLock, NULL);
 
     // Construct local address structure */
     memset( &ServAddr, 0, sizeof( ServAddr ) ); // Zero out structure
@@ -75,392 +104,461 @@ int main( int argc, char *argv[] )
     ServAddr.sin_addr.s_addr = htonl( INADDR_ANY ); // Any incoming interface
     ServAddr.sin_port = htons( ServPort );      // Local port
 
-    // Bind to the local address
-    if( bind( sock, (struct sockaddr *) &ServAddr, sizeof(ServAddr)) < 0 )
-        DieWithError( "server: bind() failed" );
+    // Every worker binds its own socket to the server port. The kernel spreads clients across them by address
+    for(int i = 0; i < threads; i++) {
+        int reuse = 1;
+
+        // Create socket for sending/receiving datagrams
+        if( ( workers[i].sock = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP ) ) < 0 )
+            DieWithError( "server: socket() failed" );
+
+        if( setsockopt( workers[i].sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse) ) < 0 )
+            DieWithError( "server: setsockopt() failed" );
+
+        // Bind to the local address
+        if( bind( workers[i].sock, (struct sockaddr *) &ServAddr, sizeof(ServAddr)) < 0 )
+            DieWithError( "server: bind() failed" );
+
+        workers[i].seed = seed + i;
+    }
+
+    for(int i = 1; i < threads; i++) {
+        if( pthread_create(&thread[i], NULL, worker, &workers[i]) != 0 )
+            DieWithError( "server: pthread_create() failed" );
+    }
+    worker(&workers[0]);
+}
 
+void* worker(void* arg) {   // Receive and handle commands on one of the server's sockets
+    struct worker* w = arg;
+    struct inbox* inbox = malloc( sizeof(struct inbox) );     // Buffers for received datagrams
+    int received;
+
+    outbox = calloc( 1, sizeof(struct outbox) );
+    rngState = w->seed;
+    if( rngState == 0 ) rngState = 1;   // xorshift never leaves the zero state
 
     while(1) {
-        cliAddrLen = sizeof( ClntAddr );
-
-        // Block until receive command from a client
-        if( ( recvfrom( sock, msgBuffer, BUFFERMAX, 0, (struct sockaddr *) &ClntAddr, &cliAddrLen )) < 0 )
-            DieWithError( "server: recvfrom() failed" );
-
-        
-        
-        if( dhtCreated == 2 && (msgBuffer[0] != 4 && msgBuffer[0] != 15) ) failure(sock, ClntAddr);    //DHT is being established, send failure
-
-        else if( msgBuffer[0] == 0 ) {  // CODE FOR REGISTER COMMAND -----------------------------------------
-
-            struct user* new_user;
-            struct user_register* datagram = (struct user_register*) msgBuffer;   //Extract data given by client
-
-            if( (new_user = user_register( datagram, user_list)) != NULL ) {
-                if(user_list == NULL) user_list = new_user;     // Add user to list
-                else {
-                    struct user* list_iterator = user_list;
-                    while(list_iterator->next != NULL) list_iterator = list_iterator->next;
-                    list_iterator->next = new_user;
-                }       
-                success(sock, ClntAddr);
-                users++;
-            }
-            else    // User or port was already in list
-                failure(sock, ClntAddr);
-
-        }
-
-        else if( msgBuffer[0] == 1 ) {  // CODE FOR DEREGISTER COMMAND -----------------------------------------
-
-            struct deregister* datagram = (struct deregister *) msgBuffer;  //Extract data given by client
-            struct user* user = find_user(datagram->user_name, user_list);
-
-            // Failure conditions
-            if(user == NULL) {
-                printf("Error: User is not registered\n");
-                failure(sock, ClntAddr);
-            }
-            if(user->state != FREE) {
-                printf("Error: User is maintaining DHT\n");
-            }
-            else {
-                deregister(datagram->user_name, &user_list);  //Deregister
-                printf("User %s deregistered\n", datagram->user_name);
-                success(sock, ClntAddr);
-                users--;
-            }
-
-        }
-
-        else if( msgBuffer[0] == 2 ) {  // CODE FOR SETUP-DHT COMMAND -----------------------------------------
-
-            struct setup* datagram = (struct setup *) msgBuffer;            // Extract data given by client
-            struct user* leader = find_user(datagram->user_name, user_list);     // Find requested dht leader
-
-            //FAILURE CONDITIONS
-            if( leader == NULL ) {   // User is not registered
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( datagram->n < 2) {                   // n is too small
-                printf("Error: DHT size must be larger\n");
-                failure(sock, ClntAddr);
-            }
-            else if( users < datagram->n ) {              // Not enough registered users
-                printf("Error: Not enough registered users\n");
-                failure(sock, ClntAddr);
-            }
-            else if( dhtCreated == 1 ) {                  //DHT has already been created
-                printf("Error: DHT has already been created\n");
-                failure(sock, ClntAddr);
-            }
-
-            //NO FAILURE
-            else{
-                // Create list containing leader, and n-1 random users for dht construction
-                leader->state = LEADER;
-                int size = datagram->n * sizeof(struct dht_user);
-                struct dht_user* dht_users = malloc( size );
-                dht_users[0] = create_dht_user(leader);
-                create_rand_list(user_list, (datagram->n)-1, dht_users + 1, users);
-
-                //Send success
-                success(sock, ClntAddr);
-                
-                // Send list to client
-                if( sendto( sock, dht_users, size , 0, (struct sockaddr *) &ClntAddr, sizeof( ClntAddr ) ) != size )
-       		        DieWithError( "setup-dht: sendto() sent a different number of bytes than expected" );
-                
-                dhtCreated = 2;
-                free(dht_users);
-            }
-
-        }
-
-        else if( msgBuffer[0] == 4 ) {  // CODE FOR DHT-COMPLETE COMMAND -----------------------------------------
-
-            struct dht_complete* datagram = (struct dht_complete*) msgBuffer;
-            struct user* leader = find_user(datagram->user_name, user_list);
-
-            if( leader == NULL ) failure(sock, ClntAddr);
-            if( leader->state != LEADER) failure(sock, ClntAddr);
-
-            printf("DHT Setup Complete\n");
-            dhtCreated = 1;
+        // Block until a command arrives, then take every other command already queued
+        if( ( received = inbox_receive( inbox, w->sock, MSG_WAITFORONE ) ) < 0 )
+            DieWithError( "server: recvmmsg() failed" );
+
+        for(int i = 0; i < received; i++) {
+            handle_command(w->sock, inbox->data[i], inbox->addr[i]);
+        }
+
+        if( outbox_flush(outbox) < 0 )
+            DieWithError( "server: sendmmsg() sent a different number of bytes than expected" );
+    }
+
+    return NULL;
+}
+
+void handle_command(int sock, char* msgBuffer, struct sockaddr_in ClntAddr) {
+    // Registration and queries only read DHT state and share it. Everything else changes it and runs alone
+    if( msgBuffer[0] == 0 || msgBuffer[0] == 6 || msgBuffer[0] == 120 ) pthread_rwlock_rdlock(&dhtLock);
+    else pthread_rwlock_wrlock(&dhtLock);
+
+    if( dhtCreated == 2 && (msgBuffer[0] != 4 && msgBuffer[0] != 15) ) failure(sock, ClntAddr);    //DHT is being established, send failure
+
+    else if( msgBuffer[0] == 0 ) {  // CODE FOR REGISTER COMMAND -----------------------------------------
+
+        struct user* new_user;
+        struct user_register* datagram = (struct user_register*) msgBuffer;   //Extract data given by client
+
+        if( (new_user = user_register( datagram, registry)) != NULL ) {
+            success(sock, ClntAddr);
+        }
+        else    // User or port was already in list
+            failure(sock, ClntAddr);
+
+    }
+
+    else if( msgBuffer[0] == 1 ) {  // CODE FOR DEREGISTER COMMAND -----------------------------------------
+
+        struct deregister* datagram = (struct deregister *) msgBuffer;  //Extract data given by client
+        struct user* user = find_user(datagram->user_name, registry);
+
+        // Failure conditions
+        if(user == NULL) {
+            printf("Error: User is not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if(user->state != FREE) {
+            printf("Error: User is maintaining DHT\n");
+        }
+        else {
+            deregister(datagram->user_name, registry);  //Deregister
+            printf("User %s deregistered\n", datagram->user_name);
+            success(sock, ClntAddr);
+        }
+
+    }
+
+    else if( msgBuffer[0] == 2 ) {  // CODE FOR SETUP-DHT COMMAND -----------------------------------------
+
+        struct setup* datagram = (struct setup *) msgBuffer;            // Extract data given by client
+        struct user* leader = find_user(datagram->user_name, registry);     // Find requested dht leader
+
+        //FAILURE CONDITIONS
+        if( leader == NULL ) {   // User is not registered
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if( datagram->n < 2) {                   // n is too small
+            printf("Error: DHT size must be larger\n");
+            failure(sock, ClntAddr);
+        }
+        else if( datagram->n > RINGMAX ) {            // n is more than a ring can hold
+            printf("Error: DHT size must be at most %d\n", RINGMAX);
+            failure(sock, ClntAddr);
+        }
+        else if( registry->freeCount < datagram->n ) {          // Not enough free registered users
+            printf("Error: Not enough registered users\n");
+            failure(sock, ClntAddr);
+        }
+        else if( dhtCreated == 1 ) {                  //DHT has already been created
+            printf("Error: DHT has already been created\n");
+            failure(sock, ClntAddr);
+        }
+
+        //NO FAILURE
+        else{
+            // Create list containing leader, and n-1 random users for dht construction
+            set_state(registry, leader, LEADER);
+            int size = datagram->n * sizeof(struct dht_user);
+            struct dht_user* dht_users = malloc( size );
+            dht_users[0] = create_dht_user(leader);
+            create_rand_list(registry, (datagram->n)-1, dht_users + 1);
+
+            //Send success
             success(sock, ClntAddr);
+            
+            // Send list to client
+            reply(sock, dht_users, size, ClntAddr);
+            
+            dhtCreated = 2;
+            free(dht_users);
+        }
+
+    }
+
+    else if( msgBuffer[0] == 4 ) {  // CODE FOR DHT-COMPLETE COMMAND -----------------------------------------
+
+        struct dht_complete* datagram = (struct dht_complete*) msgBuffer;
+        struct user* leader = find_user(datagram->user_name, registry);
+
+        if( leader == NULL ) failure(sock, ClntAddr);
+        if( leader->state != LEADER) failure(sock, ClntAddr);
+
+        printf("DHT Setup Complete\n");
+        dhtCreated = 1;
+        success(sock, ClntAddr);
 
+    }
+
+    else if ( msgBuffer[0] == 6 ) { // CODE FOR QUERY-DHT COMMAND -----------------------------------------
+
+        struct query_dht* datagram = (struct query_dht*) msgBuffer;
+        struct user* queryUser = find_user(datagram->user_name, registry);
+        struct user* randomUser;
+        struct query_dht query;
+
+
+        // Failure Conditions
+        if( dhtCreated != 1 ) {
+            printf("Error: DHT not created\n");
+            failure(sock, ClntAddr);
+        }
+        else if( queryUser == NULL ) {
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
         }
+        else if( queryUser->state != FREE ) {
+            printf("Error: User is in DHT\n");
+            failure(sock, ClntAddr);
+        }
+        // Pick random user to be inital query node
+        else if( (randomUser = get_random_user(registry)) == NULL ) {
+            printf("Error: DHT has no members\n");
+            failure(sock, ClntAddr);
+        }
+        // Success
+        else {
+            // Send random user to client initiating query
+            query.command = 6;
+            strcpy(query.user_name, randomUser->user_name);
+            strcpy(query.ipAddr, randomUser->ipAddr);
+            query.portQuery = randomUser->portQuery;
 
-        else if ( msgBuffer[0] == 6 ) { // CODE FOR QUERY-DHT COMMAND -----------------------------------------
-
-            struct query_dht* datagram = (struct query_dht*) msgBuffer;
-            struct user* queryUser = find_user(datagram->user_name, user_list);
-            struct user* randomUser;
-            struct query_dht query;
-
-
-            // Failure Conditions
-            if( dhtCreated != 1 ) {
-                printf("Error: DHT not created\n");
-                failure(sock, ClntAddr);
-            }
-            else if( queryUser == NULL ) {
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( queryUser->state != FREE ) {
-                printf("Error: User is in DHT\n");
-                failure(sock, ClntAddr);
-            }
-            // Success
-            else {
-                // Pick random user to be inital query node
-                randomUser = get_random_user(user_list, users);
-
-                // Send random user to client initiating query
-                query.command = 6;
-                strcpy(query.user_name, randomUser->user_name);
-                strcpy(query.ipAddr, randomUser->ipAddr);
-                query.portQuery = randomUser->portQuery;
-
-                if( sendto( sock, &query, sizeof(query) , 0, (struct sockaddr *) &ClntAddr, sizeof( ClntAddr ) ) != sizeof(query) )
-       		        DieWithError( "query-dht: sendto() sent a different number of bytes than expected" );
-            }
-
-        }
-
-        else if ( msgBuffer[0] == 9 ) { // CODE FOR LEAVE-DHT COMMAND -----------------------------------------
-
-            struct leave_dht* datagram = (struct leave_dht*) msgBuffer;
-            struct user* user = find_user(datagram->user_name, user_list);
-
-            // Failure conditions
-            if( dhtCreated == 0 ){
-                printf("Error: DHT does not exist\n");
-                failure(sock, ClntAddr);
-            }
-            else if( user == NULL ) {
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( user->state == FREE ) {
-                printf("Error: User is not involved in maintaining DHT\n");
-                failure(sock, ClntAddr);
-            }
-            else if( datagram->ring_size < 2 ) {
-                printf("Error: Not enough users maintaing DHT\n");
-                failure(sock, ClntAddr);
-            }
-            // Success
-            else {
-                strcpy(user_tmp, datagram->user_name);
-                dhtCreated = 2;
-                success(sock, ClntAddr);
-            }
-
-        }
-
-        else if ( msgBuffer[0] == 15 ) { // CODE FOR DHT-REBUILT COMMAND -----------------------------------------
-
-            struct dht_rebuilt* datagram = (struct dht_rebuilt*) msgBuffer;
-            struct user* user = find_user(datagram->user_name, user_list);
-            struct user* new_leader = find_user(datagram->new_leader, user_list);
-            struct user* old_leader = get_leader(user_list);
-
-            //Failure conditions
-            if(strcmp(datagram->user_name, user_tmp) != 0) {
-                printf("Error: DHT Rebuilt user did not send the initiating command\n");
-                failure(sock, ClntAddr);
-            }
-
-            if(datagram->FLAG) {      // JOIN-DHT
-                old_leader->state = INDHT;
-                user->state = FREE;
-                new_leader->state = LEADER;
-                dhtCreated = 1;
-                printf("%s has joined the DHT\n", user->user_name);
-            }
-            else {          // LEAVE-DHT
-                old_leader->state = INDHT;
-                user->state = FREE;
-                new_leader->state = LEADER;
-                dhtCreated = 1;
-                printf("%s has left the DHT\n", user->user_name);
-            }
-
-        }
-
-        else if ( msgBuffer[0] == 16 ) { // CODE FOR JOIN-DHT COMMAND -----------------------------------------
-
-            struct join_dht* datagram = (struct join_dht*) msgBuffer;
-            struct user* user = find_user(datagram->user_name, user_list);
-            struct user* leader = get_leader(user_list);
-            struct join_dht join;
-
-            // Failure conditions
-            if( dhtCreated == 0 ){
-                printf("Error: DHT does not exist\n");
-                failure(sock, ClntAddr);
-            }
-            else if( user == NULL ) {
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( user->state != FREE ) {
-                printf("Error: User is already involved in maintaining DHT\n");
-                failure(sock, ClntAddr);
-            }
-            // Success
-            else {
-                strcpy(user_tmp, datagram->user_name);
-                dhtCreated = 2;
-                
-                join.command = 16;
-                strcpy(join.user_name, user->user_name);
-                join.leader = create_dht_user(leader);
-                join.ring_size = get_ring_size(user_list);
-
-                if( sendto( sock, &join, sizeof(join) , 0, (struct sockaddr *) &ClntAddr, sizeof( ClntAddr ) ) != sizeof(join) )
-       		        DieWithError( "join-dht: sendto() sent a different number of bytes than expected" );
-            }
-
-        }
-
-        else if ( msgBuffer[0] == 17 ) { // CODE FOR TEARDOWN-DHT COMMAND -----------------------------------------
-
-            struct teardown_dht* datagram = (struct teardown_dht*) msgBuffer;
-            struct user* leader = find_user(datagram->user_name, user_list);
-
-            // Failure conditions
-            if( dhtCreated == 0 ) {
-                printf("Error: DHT not created\n");
-                failure(sock,ClnetAddr);
-            }
-            if( leader == NULL ) {
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( leader->state != LEADER ) {
-                printf("Error: User is not the leader\n");
-                failure(sock, ClntAddr);
-            }
-            // Success
-            else success(sock, ClntAddr);
-
-        }
-
-        else if ( msgBuffer[0] == 18 ) { // CODE FOR TEARDOWN-COMPLETE COMMAND -----------------------------------------
-
-            struct teardown_complete* datagram = (struct teardown_complete*) msgBuffer;
-            struct user* leader = find_user(datagram->user_name, user_list);
-
-            // Failure conditions
-            if( leader == NULL ) {
-                printf("Error: User not registered\n");
-                failure(sock, ClntAddr);
-            }
-            else if( leader->state != LEADER ) {
-                printf("Error: User is not the leader\n");
-                failure(sock, ClntAddr);
-            }
-            // Success
-            else {
-                // Set the state of every user to free
-                set_free(user_list);
-                dhtCreated = 0;
-
-                printf("DHT Torn down\n");
-                success(sock, ClntAddr);
-            }
-        }
-
-        else if( msgBuffer[0] == 120 ) {
-
-            printf("Successful Test\n");
+            reply(sock, &query, sizeof(query), ClntAddr);
+        }
 
+    }
+
+    else if ( msgBuffer[0] == 9 ) { // CODE FOR LEAVE-DHT COMMAND -----------------------------------------
+
+        struct leave_dht* datagram = (struct leave_dht*) msgBuffer;
+        struct user* user = find_user(datagram->user_name, registry);
+
+        // Failure conditions
+        if( dhtCreated == 0 ){
+            printf("Error: DHT does not exist\n");
+            failure(sock, ClntAddr);
+        }
+        else if( user == NULL ) {
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if( user->state == FREE ) {
+            printf("Error: User is not involved in maintaining DHT\n");
+            failure(sock, ClntAddr);
+        }
+        else if( datagram->ring_size < 2 ) {
+            printf("Error: Not enough users maintaing DHT\n");
+            failure(sock, ClntAddr);
+        }
+        // Success
+        else {
+            strcpy(user_tmp, datagram->user_name);
+            dhtCreated = 2;
+            success(sock, ClntAddr);
+        }
+
+    }
+
+    else if ( msgBuffer[0] == 15 ) { // CODE FOR DHT-REBUILT COMMAND -----------------------------------------
+
+        struct dht_rebuilt* datagram = (struct dht_rebuilt*) msgBuffer;
+        struct user* user = find_user(datagram->user_name, registry);
+        struct user* new_leader = find_user(datagram->new_leader, registry);
+        struct user* old_leader = get_leader(registry);
+
+        //Failure conditions
+        if(strcmp(datagram->user_name, user_tmp) != 0) {
+            printf("Error: DHT Rebuilt user did not send the initiating command\n");
+            failure(sock, ClntAddr);
         }
+
+        if(datagram->FLAG) {      // JOIN-DHT
+            set_state(registry, old_leader, INDHT);
+            set_state(registry, user, FREE);
+            set_state(registry, new_leader, LEADER);
+            dhtCreated = 1;
+            printf("%s has joined the DHT\n", user->user_name);
+        }
+        else {          // LEAVE-DHT
+            set_state(registry, old_leader, INDHT);
+            set_state(registry, user, FREE);
+            set_state(registry, new_leader, LEADER);
+            dhtCreated = 1;
+            printf("%s has left the DHT\n", user->user_name);
+        }
+
     }
+
+    else if ( msgBuffer[0] == 16 ) { // CODE FOR JOIN-DHT COMMAND -----------------------------------------
+
+        struct join_dht* datagram = (struct join_dht*) msgBuffer;
+        struct user* user = find_user(datagram->user_name, registry);
+        struct user* leader = get_leader(registry);
+        struct join_dht join;
+
+        // Failure conditions
+        if( dhtCreated == 0 ){
+            printf("Error: DHT does not exist\n");
+            failure(sock, ClntAddr);
+        }
+        else if( user == NULL ) {
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if( user->state != FREE ) {
+            printf("Error: User is already involved in maintaining DHT\n");
+            failure(sock, ClntAddr);
+        }
+        else if( get_ring_size(registry) >= RINGMAX ) {
+            printf("Error: DHT is full\n");
+            failure(sock, ClntAddr);
+        }
+        // Success
+        else {
+            strcpy(user_tmp, datagram->user_name);
+            dhtCreated = 2;
+            
+            join.command = 16;
+            strcpy(join.user_name, user->user_name);
+            join.leader = create_dht_user(leader);
+            join.ring_size = get_ring_size(registry);
+
+            reply(sock, &join, sizeof(join), ClntAddr);
+        }
+
+    }
+
+    else if ( msgBuffer[0] == 17 ) { // CODE FOR TEARDOWN-DHT COMMAND -----------------------------------------
+
+        struct teardown_dht* datagram = (struct teardown_dht*) msgBuffer;
+        struct user* leader = find_user(datagram->user_name, registry);
+
+        // Failure conditions
+        if( dhtCreated == 0 ) {
+            printf("Error: DHT not created\n");
+            failure(sock, ClntAddr);
+        }
+        if( leader == NULL ) {
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if( leader->state != LEADER ) {
+            printf("Error: User is not the leader\n");
+            failure(sock, ClntAddr);
+        }
+        // Success
+        else success(sock, ClntAddr);
+
+    }
+
+    else if ( msgBuffer[0] == 18 ) { // CODE FOR TEARDOWN-COMPLETE COMMAND -----------------------------------------
+
+        struct teardown_complete* datagram = (struct teardown_complete*) msgBuffer;
+        struct user* leader = find_user(datagram->user_name, registry);
+
+        // Failure conditions
+        if( leader == NULL ) {
+            printf("Error: User not registered\n");
+            failure(sock, ClntAddr);
+        }
+        else if( leader->state != LEADER ) {
+            printf("Error: User is not the leader\n");
+            failure(sock, ClntAddr);
+        }
+        // Success
+        else {
+            // Set the state of every user to free
+            set_free(registry);
+            dhtCreated = 0;
+
+            printf("DHT Torn down\n");
+            success(sock, ClntAddr);
+        }
+    }
+
+    else if( msgBuffer[0] == 120 ) {
+
+        printf("Successful Test\n");
+
+    }
+
+    pthread_rwlock_unlock(&dhtLock);
 }
 
 //Command Functions
-struct user* user_register( struct user_register* user_info, struct user* user_list ) {
+struct user* user_register( struct user_register* user_info, struct registry* registry ) {
     struct user* new_user = malloc( sizeof( struct user ) );    //Create new user struct
     strcpy(new_user->user_name, user_info->user_name);          //Populate fields with info from received :18:
     strcpy(new_user->ipAddr, user_info->ipAddr);
     new_user->portFrom = user_info->portFrom;
     new_user->portTo = user_info->portTo;
     new_user->portQuery = user_info->portQuery;
+    new_user->vnodes = user_info->vnodes;
+    if(new_user->vnodes < 1 || new_user->vnodes > VNODEMAX) new_user->vnodes = VNODES;
     new_user->state = FREE;
     new_user->next = NULL;
 
     printf("Received User: %s\n", new_user->user_name);
 
-    if( !check_user_unique( new_user, user_list )) {  // Check that user parameters are unique
+    int bucket = hash_name(new_user->user_name) & (NAMEBUCKETS - 1);
+    pthread_mutex_t* shard = &registry->nameLocks[bucket % NAMESHARDS];
+
+    pthread_mutex_lock(shard);
+    if( !check_user_unique( new_user, registry )) {  // Check that user parameters are unique
+        pthread_mutex_unlock(shard);
         free(new_user);
         return NULL;
     }
-    else {
-        return new_user;
+
+    // Append to the dense user array
+    pthread_mutex_lock(&registry->poolLock);
+    if( registry->count == registry->capacity ) {
+        registry->capacity = registry->capacity ? registry->capacity * 2 : 64;
+        registry->users = realloc(registry->users, registry->capacity * sizeof(struct user*));
+        registry->freeUsers = realloc(registry->freeUsers, registry->capacity * sizeof(struct user*));
+        registry->dhtUsers = realloc(registry->dhtUsers, registry->capacity * sizeof(struct user*));
     }
+    new_user->slot = registry->count;
+    registry->users[registry->count++] = new_user;
+    pool_add(registry, new_user);
+    registry->states[FREE]++;
+    pthread_mutex_unlock(&registry->poolLock);
+
+    // Index by name
+    new_user->next = registry->names[bucket];
+    registry->names[bucket] = new_user;
+    pthread_mutex_unlock(shard);
+
+    return new_user;
 }
 
-int check_user_unique( struct user* u, struct user* list ) { 
+int check_user_unique( struct user* u, struct registry* registry ) {    // Caller holds the name shard of u
     if( u->portFrom == u->portTo || u->portFrom == u->portQuery || u->portTo == u->portQuery ) return 0;
-    while(list != NULL) {
-        if( strcmp( u->user_name, list->user_name ) == 0) return 0;     //Check for matching username
-        if( u->portFrom == list->portFrom  || u->portFrom == list->portTo || u->portFrom == list->portQuery) return 0;      //Check for any matching ports
-        if( u->portTo == list->portFrom || u->portTo == list->portTo || u->portTo == list->portQuery ) return 0;
-        if( u->portQuery == list->portFrom  || u->portQuery == list->portTo || u->portQuery == list->portQuery) return 0;
-        list = list->next;
-    }
+    if( find_in_bucket(u->user_name, registry) != NULL ) return 0;     //Check for matching username
+    if( !claim_ports(registry, u) ) return 0;     //Check for any matching ports
 
     return 1;
 }
 
-int deregister( char* name, struct user** head) {
-    struct user* ulist = *head;
-    struct user* tmp;
+int deregister( char* name, struct registry* registry) {
+    int bucket = hash_name(name) & (NAMEBUCKETS - 1);
+    struct user** link = &registry->names[bucket];
+    struct user* u;
 
-    if( ulist == NULL ) return 0;                       // List is empty
-    else if( strcmp(ulist->user_name, name) == 0 )  {    // User is the head
-        *head = ulist->next;
-        free(ulist);
-        return 1;
-    }
-    else {
-        while( ulist->next != NULL ){
-            if( strcmp(ulist->next->user_name, name) == 0) {    // User is in the middle of the list or tail
-                tmp = ulist->next;
-                ulist->next = ulist->next->next;
-                free(tmp);
-                return 1;
-            }
-            ulist = ulist->next;
-        }
-    }
+    while( *link != NULL && strcmp((*link)->user_name, name) != 0 ) link = &(*link)->next;
+    if( *link == NULL ) return 0;   // User was not registered
+
+    // Unlink from the name index. The caller holds dhtLock for writing, so no registration is running
+    u = *link;
+    *link = u->next;
+
+    // Swap the last user into this user's place in the dense array
+    registry->users[u->slot] = registry->users[--registry->count];
+    registry->users[u->slot]->slot = u->slot;
+
+    pool_remove(registry, u);
+    mark_ports(registry, u, 0);
+    registry->states[u->state]--;
+    if( registry->leader == u ) registry->leader = NULL;
+    free(u);
 
-    return 0;   // User was not in list
+    return 1;
 }
 
-struct user* find_user(char* name, struct user* list) { // Find a registered user with a given name
-    while(list != NULL) {
-        if( strcmp(name, list->user_name) == 0 ) return list;
-        list = list->next;
-    }
+struct user* find_user(char* name, struct registry* registry) { // Find a registered user with a given name
+    pthread_mutex_t* shard = &registry->nameLocks[(hash_name(name) & (NAMEBUCKETS - 1)) % NAMESHARDS];
+    struct user* u;
 
-    return NULL;
+    pthread_mutex_lock(shard);
+    u = find_in_bucket(name, registry);
+    pthread_mutex_unlock(shard);
+
+    return u;
 }
 
-struct user* get_user(struct user* list, int n){    // Reuturns user at index i of list of registered users
-    if(list == NULL) return NULL;
+struct user* find_in_bucket(char* name, struct registry* registry) {    // find_user for callers holding the name's shard
+    struct user* u = registry->names[hash_name(name) & (NAMEBUCKETS - 1)];
 
-  for(int i = 0; i < n; i++) {
-        if (list->next == NULL) return NULL;
-        list = list->next;
+    while(u != NULL) {
+        if( strcmp(name, u->user_name) == 0 ) return u;
+        u = u->next;
     }
 
-    return list;
+    return NULL;
+}
+
+struct user* get_user(struct registry* registry, int n){    // Returns user at index n of registered users
+    if(n < 0 || n >= registry->count) return NULL;
+
+    return registry->users[n];
 }
 
 struct dht_user create_dht_user(struct user* u) {   // Given a registered user, create a dht_user struct
@@ -471,6 +569,7 @@ struct dht_user create_dht_user(struct user* u) {   // Given a registered user,
     user.portFrom = u->portFrom;
     user.portTo = u->portTo;
     user.portQuery = u->portQuery;
+    user.vnodes = u->vnodes;
 
     return user;
 }
@@ -483,63 +582,106 @@ int is_in(char* name, struct dht_user* list, int n) {   // Returns true if a giv
     return 0;
 }
 
-struct user* create_rand_list( struct user* list, int n, struct dht_user* dht_users, int users ) {
-    struct user* u;
+struct user* create_rand_list( struct registry* registry, int n, struct dht_user* dht_users ) {
+    struct user* u = NULL;
 
+    // Partial Fisher-Yates shuffle of the free users: each pick leaves the free pool, so no user is drawn twice
     for(int i = 0; i < n; i++){
-        int j = rand() % users;
-        u = get_user(list, j);
-
-        if(u->state == INDHT || u->state == LEADER) {
-            i--;
-            continue;
-        }
-        else {
-            dht_users[i] = create_dht_user(u);
-            u->state = INDHT;
-        }
+        u = registry->freeUsers[ random_below(registry->freeCount) ];
+        dht_users[i] = create_dht_user(u);
+        set_state(registry, u, INDHT);
     }
-    
+
+    return u;
 }
 
-struct user* get_random_user(struct user* list, int users) {
-    struct user* u;
+struct user* get_random_user(struct registry* registry) {   // Returns a random user in the DHT, or NULL if it is empty
+    struct user* u = NULL;
 
-    while(1) {
-        int j = rand() % users;
-        u = get_user(list, j);
-        if(u->state != FREE)
-            break;
-    }
+    pthread_mutex_lock(&registry->poolLock);    // Registrations may be growing the pools
+    if(registry->dhtCount > 0) u = registry->dhtUsers[ random_below(registry->dhtCount) ];
+    pthread_mutex_unlock(&registry->poolLock);
 
     return u;
 }
 
-struct user* get_leader(struct user* list) {
-    while(list != NULL) {
-        if(list->state == LEADER) break;
-        list = list->next;
-    }
+struct user* get_leader(struct registry* registry) {
+    return registry->leader;
+}
 
-    if(list == NULL) return NULL;
-    else return list;
+int get_ring_size(struct registry* registry) {
+    return registry->states[LEADER] + registry->states[INDHT];
 }
 
-int get_ring_size(struct user* list) {
-    int size;
+void set_state(struct registry* registry, struct user* u, State state) {   // Change a user's state, keeping the counters and pools current
+    registry->states[u->state]--;
+    registry->states[state]++;
 
-    while(list != NULL) {
-        if(list->state != FREE) size++;
-        list = list->next;
+    if( registry->leader == u ) registry->leader = NULL;
+    if( state == LEADER ) registry->leader = u;
+
+    // Move between the free and DHT pools
+    if( (u->state == FREE) != (state == FREE) ) {
+        pool_remove(registry, u);
+        u->state = state;
+        pool_add(registry, u);
+    }
+    else u->state = state;
+}
+
+void pool_add(struct registry* registry, struct user* u) {      // Append a user to the pool for its state
+    if( u->state == FREE ) {
+        u->poolSlot = registry->freeCount;
+        registry->freeUsers[registry->freeCount++] = u;
+    }
+    else {
+        u->poolSlot = registry->dhtCount;
+        registry->dhtUsers[registry->dhtCount++] = u;
     }
+}
+
+void pool_remove(struct registry* registry, struct user* u) {   // Swap the last user of u's pool into u's place
+    struct user** pool = u->state == FREE ? registry->freeUsers : registry->dhtUsers;
+    int* count = u->state == FREE ? &registry->freeCount : &registry->dhtCount;
+
+    pool[u->poolSlot] = pool[--(*count)];
+    pool[u->poolSlot]->poolSlot = u->poolSlot;
+}
+
+int random_below(int bound) {   // Uniform random number in [0, bound) from xorshift64*
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
 
-    return size;
+    return ((rngState * 2685821657736338717ULL) >> 32) * bound >> 32;
 }
 
-void set_free(struct user* list) {
-    while(list != NULL) {
-        list->state = FREE;
-        list = list->next;
+void set_free(struct registry* registry) {
+    for(int i = 0; i < registry->count; i++) {
+        set_state(registry, registry->users[i], FREE);
     }
 }
 
+int claim_ports(struct registry* registry, struct user* u) {   // Atomically mark a user's ports as owned, or fail if any is taken
+    unsigned short ports[3] = { u->portFrom, u->portTo, u->portQuery };
+
+    for(int i = 0; i < 3; i++) {
+        unsigned char bit = 1 << (ports[i] % 8);
+
+        if( __atomic_fetch_or(&registry->ports[ports[i] / 8], bit, __ATOMIC_ACQ_REL) & bit ) {
+            while(i-- > 0) __atomic_fetch_and(&registry->ports[ports[i] / 8], ~(1 << (ports[i] % 8)), __ATOMIC_ACQ_REL);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void mark_ports(struct registry* registry, struct user* u, int used) {    // Set or clear the ports owned by a user
+    unsigned short ports[3] = { u->portFrom, u->portTo, u->portQuery };
+
+    for(int i = 0; i < 3; i++) {
+        if(used) __atomic_fetch_or(&registry->ports[ports[i] / 8], 1 << (ports[i] % 8), __ATOMIC_ACQ_REL);
+        else __atomic_fetch_and(&registry->ports[ports[i] / 8], ~(1 << (ports[i] % 8)), __ATOMIC_ACQ_REL);
+    }
+}
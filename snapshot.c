@@ -0,0 +1,110 @@
+#include "defn.h"
+
+// Converts a dataset into the binary snapshot peers map at setup instead of parsing the dataset
+// Usage: ./snapshot <dataset file> <snapshot file>
+// Records are parsed and hashed once here. Peers look for SNAPSHOTFILE in their working directory,
+// and use it while DATASETFILE there has the size and modification time the dataset had here
+
+struct parsed {                 // A record packed with encode_entry, before sorting
+    uint64_t hash;
+    uint32_t offset;            // In the packed buffer
+    uint32_t length;
+};
+
+int compare_hash(const void* a, const void* b) {
+    uint64_t x = ((struct parsed*) a)->hash, y = ((struct parsed*) b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+int main( int argc, char *argv[] ) {
+    struct dht_entry record;
+    struct dataset data;
+    struct snapshot_header header = { SNAPSHOTMAGIC };
+    struct snapshot_index entry;
+    struct stat info;
+    struct parsed* records;
+    char* packed;
+    size_t packedBytes = 0, packedMax, recordMax, count = 0;
+    FILE* out;
+
+    if( argc != 3 ) {
+        fprintf( stderr, "Usage: %s <dataset file> <snapshot file>\n", argv[0] );
+        exit( 1 );
+    }
+
+    if( stat(argv[1], &info) < 0 || !dataset_open(&data, argv[1]) ) {
+        perror( "snapshot: dataset_open() failed" );
+        exit( 1 );
+    }
+
+    recordMax = 1024;
+    packedMax = recordMax * ENTRYMAX;
+    records = malloc(recordMax * sizeof(struct parsed));
+    packed = malloc(packedMax);
+
+    read_record(&record, &data);    // Skip header line
+    while( read_record(&record, &data) ) {
+        if( count == recordMax ) {
+            recordMax *= 2;
+            records = realloc(records, recordMax * sizeof(struct parsed));
+        }
+        if( packedBytes + ENTRYMAX > packedMax ) {
+            packedMax *= 2;
+            packed = realloc(packed, packedMax);
+        }
+        if( records == NULL || packed == NULL ) {
+            fprintf( stderr, "snapshot: out of memory\n" );
+            exit( 1 );
+        }
+
+        records[count].hash = record.hash;
+        records[count].offset = packedBytes;
+        records[count].length = encode_entry(packed + packedBytes, &record);
+        packedBytes += records[count].length;
+        count++;
+    }
+    dataset_close(&data);
+
+    if( packedBytes > UINT32_MAX ) {
+        fprintf( stderr, "snapshot: dataset too large\n" );
+        exit( 1 );
+    }
+
+    qsort(records, count, sizeof(struct parsed), compare_hash);
+
+    if( (out = fopen(argv[2], "wb")) == NULL ) {
+        perror( "snapshot: fopen() failed" );
+        exit( 1 );
+    }
+
+    header.count = count;
+    header.dataBytes = packedBytes;
+    header.sourceBytes = info.st_size;
+    header.sourceSec = info.st_mtim.tv_sec;
+    header.sourceNsec = info.st_mtim.tv_nsec;
+    fwrite(&header, sizeof(header), 1, out);
+
+    // Index, with offsets of the records as they are laid out below
+    entry.offset = 0;
+    for(size_t i = 0; i < count; i++) {
+        entry.hash = records[i].hash;
+        entry.length = records[i].length;
+        fwrite(&entry, sizeof(entry), 1, out);
+        entry.offset += entry.length;
+    }
+
+    // Packed records in index order
+    for(size_t i = 0; i < count; i++) fwrite(packed + records[i].offset, records[i].length, 1, out);
+
+    if( fclose(out) != 0 ) {
+        perror( "snapshot: fclose() failed" );
+        exit( 1 );
+    }
+
+    printf("%zu records, %zu bytes of packed records\n", count, packedBytes);
+
+    free(records);
+    free(packed);
+    return 0;
+}